@@ -21,9 +21,13 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #ifndef WITHOUT_INOTIFY
 #include <sys/inotify.h>
-#include <poll.h>
 #endif
 #include <fcntl.h>
 #include <netdb.h>
@@ -33,10 +37,13 @@
 #include <execinfo.h>
 
 #include <string>
-#ifndef WITHOUT_EMAIL
 #include <sstream>
-#endif
 #include <vector>
+#include <list>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <set>
 #include <ctime>
 #include <cstring>
 #include <algorithm>
@@ -44,6 +51,8 @@
 #include <csignal>
 #include <iostream>
 #include <cstddef>
+#include <cerrno>
+#include <cctype>
 
 #define unreferenced_parameter(p) (void)p
 #define unused_return(f) if (f) {}
@@ -57,33 +66,132 @@ static unsigned int const MaxAttempts    = 5;
 static time_t const HostExpire           = 5;
 static unsigned int const FailurePenalty = 1;
 static unsigned int const BackTraceSize  = 100;
+static unsigned int const MaxClients     = 8;
+static size_t const MaxLine              = 4096;
+static size_t const MaxRequest           = 256;
+static size_t const MaxPending           = 64 * 1024;
+static size_t const StreamSlice          = 256;
+static size_t const MaxSessions          = 256;
+static unsigned long int const DefaultTop = 10;
+static int const MaxEvents               = 16;
+static long int const MinPollInterval    = 250;
+static long int const MaxPollInterval    = 1000;
 static char const * const AuthLogFile    = AUTHLOG_FILE;
 static char const * const DenyFile       = DENY_FILE;
+static char const * const ControlFile    = CONTROL_SOCKET;
+static char const * RulesFile            = RULES_FILE;
+#ifdef WITH_IPV4
+static char const * const DefaultFamilies = "IPv4 and IPv6";
+#else
+static char const * const DefaultFamilies = "IPv6 only";
+#endif
 static char MailCommand[HOST_NAME_MAX + sizeof(MailCommandTpl) / sizeof(MailCommandTpl[0])];
 static char CrashMail[HOST_NAME_MAX + sizeof(CrashMailTpl) / sizeof(CrashMailTpl[0])];
 
 static volatile std::sig_atomic_t AlreadyCrashed = 0;
+// Handled by the main loop, and blocked otherwise
+static sigset_t LoopSignals;
+
+// An address or a network, in binary form
+struct Prefix {
+    int           Family;
+    unsigned char Address[sizeof(struct in6_addr)];
+    unsigned int  Length;
+};
 
 struct HostIP {
     time_t            FirstSeen;
+    // As logged, Binary is what it's looked up with
     std::string       Address;
+    Prefix            Binary;
+    int               Family;
     long unsigned int Attempts;
     time_t            Expire;
     bool              Written;
+    // Generation of the table it was added in
+    long unsigned int Born;
 
-    HostIP(time_t Date, const std::string & AuthAddress, long unsigned int InitAttempt, bool AlreadyWritten)
-      : FirstSeen(Date), Address(AuthAddress), Attempts(InitAttempt), Written(AlreadyWritten) {
+    HostIP(time_t Date, const std::string & AuthAddress, const Prefix & AuthBinary,
+           long unsigned int InitAttempt, bool AlreadyWritten)
+      : FirstSeen(Date), Address(AuthAddress), Binary(AuthBinary), Family(AuthBinary.Family),
+        Attempts(InitAttempt), Written(AlreadyWritten), Born(0) {
         Expire    = Date + (Attempts * FailurePenalty * HostExpire * 60);
         Written   = false;
     }
 };
 
+// Addresses of a network follow it in that order
+struct AddressOrder {
+    bool operator() (const Prefix & lhs, const Prefix & rhs) const {
+        if (lhs.Family != rhs.Family) {
+            return (lhs.Family < rhs.Family);
+        }
+
+        return (memcmp(lhs.Address, rhs.Address, sizeof(lhs.Address)) < 0);
+    }
+};
+
 struct Closer {
-    bool operator() (const HostIP & lhs, const HostIP & rhs) const {
-        return (lhs.Expire > rhs.Expire);
+    bool operator() (const HostIP * lhs, const HostIP * rhs) const {
+        if (lhs->Expire != rhs->Expire) {
+            return (lhs->Expire < rhs->Expire);
+        }
+
+        return AddressOrder()(lhs->Binary, rhs->Binary);
+    }
+};
+
+struct MoreAttempts {
+    bool operator() (const HostIP * lhs, const HostIP * rhs) const {
+        if (lhs->Attempts != rhs->Attempts) {
+            return (lhs->Attempts > rhs->Attempts);
+        }
+
+        return AddressOrder()(lhs->Binary, rhs->Binary);
     }
 };
 
+typedef std::map<Prefix, HostIP, AddressOrder> HostMap;
+
+// A DUMP being streamed: the hosts as they were when it was requested
+// Hosts not streamed yet are saved here before they change
+struct Snapshot {
+    long unsigned int Generation;
+    // Last address streamed, if Started
+    bool              Started;
+    Prefix            Cursor;
+    HostMap           Saved;
+};
+
+// The hosts by address, indexed by expire date and by attempts
+// The indexes point into Tracked, and follow its changes
+struct HostTable {
+    HostMap                                Tracked;
+    std::set<const HostIP *, Closer>       Expiries;
+    std::set<const HostIP *, MoreAttempts> Ranks;
+    // Bumped by each snapshot, hosts added after it aren't part of it
+    long unsigned int                      Generation;
+    std::list<Snapshot>                    Snapshots;
+
+    HostTable() : Generation(0) {}
+};
+
+// All decisions are taken with the time given by Now()
+// That's the system time, unless a log is being replayed
+static time_t VirtualTime = 0;
+
+static time_t SystemClock() {
+    return time(0);
+}
+
+static time_t VirtualClock() {
+    return VirtualTime;
+}
+
+typedef time_t (*Clock)();
+
+static Clock Now = SystemClock;
+
 static void Assert(const char * File, unsigned int Line, const char * Assert,
                    bool Critical = false) {
     syslog((Critical ? LOG_CRIT : LOG_NOTICE),
@@ -95,12 +203,6 @@ static void Assert(const char * File, unsigned int Line, const char * Assert,
     }
 }
 
-static void SignalHandler(int Signal) {
-    unreferenced_parameter(Signal);
-    syslog(LOG_INFO, "Deamon shutting down.");
-    exit(EXIT_SUCCESS);
-}
-
 static void ExceptionHandler(int Signal, siginfo_t * SigInfo, void * Context) {
     void * Buffer[BackTraceSize];
     char ** Strings;
@@ -178,580 +280,2562 @@ static void ExceptionHandler(int Signal, siginfo_t * SigInfo, void * Context) {
     free(Strings);
 }
 
-static bool ExtractData(char * Begin, char ** Address, size_t & AddressLength) {
-    char * User;
-    char * Host;
-    char * End;
-    char * Colon;
-#ifdef WITH_IPV4
-    char * Dot;
-#endif
+template <typename Policy>
+static bool IsValidAddress(const char * Host, const char * End) {
+    char Buffer[INET6_ADDRSTRLEN];
+    typename Policy::Binary Binary;
+    size_t Length = (Policy::AddressEnd(Host, End) - Host);
 
-    // For an user
-    User = strstr(Begin, " for ");
-    if (User == 0) {
+    // Too long to be an address of any family
+    if (Length >= sizeof(Buffer)) {
         return false;
     }
-    User += sizeof(" for ");
 
-    // From an host
-    Host = strstr(User, " from ");
-    if (Host == 0) {
-        return false;
-    }
-    // It is mandatory not to take \0 into account
-    Host += sizeof(" from ") - sizeof(char);
+    // inet_pton() wants a null terminated string
+    memcpy(Buffer, Host, Length);
+    Buffer[Length] = '\0';
 
-    // With a port
-    End = strstr(Host, " port ");
-    if (End == 0) {
-        return false;
-    }
+    return (inet_pton(Policy::Family, Buffer, &Binary) == 1);
+}
 
-#ifdef WITH_IPV4
-    // We might have either IPv4 or IPv6 here
-    Colon = strchr(Host, ':');
-    Dot = strchr(Host, '.');
-    if ((Colon == 0 || Colon > End) &&
-        (Dot == 0 || Dot > End)) {
-        return false;
-    }
-#else
-    // Finaly, ensure we have IPv6
-    // Ignore any other IPs not to interfere with
-    // other deamons
-    Colon = strchr(Host, ':');
-    if (Colon == 0 || Colon > End) {
-        return false;
+// Address family policies
+// Each of them knows how to recognize, validate and format
+// the addresses of its family. Parsing code is specialized
+// on them, so that each enabled configuration gets its own path
+struct IPv4 {
+    typedef struct in_addr Binary;
+    typedef struct sockaddr_in SockAddr;
+
+    static const int Family = AF_INET;
+    static const char Separator = '.';
+    static const unsigned int Bits = 32;
+
+    static const char * AddressEnd(const char * Host, const char * End) {
+        unreferenced_parameter(Host);
+        return End;
     }
-#endif
 
-    // Return host
-    *Address = Host;
-    AddressLength = (End - Host);
+    static std::string DenyEntry(const std::string & Host) {
+        return "sshd: " + Host + "\n";
+    }
 
-    return true;
-}
+    // Networks are written with their netmask, that is what
+    // hosts_access(5) understands for IPv4
+    static std::string DenyEntry(const std::string & Network, unsigned int Length) {
+        struct in_addr Mask;
+        char Buffer[INET_ADDRSTRLEN];
 
-static bool IsMessageRepeated(char * Line, char ** Address,
-                              size_t & AddressLength, long unsigned int & Attempts) {
-    char * SSHd;
-    char * Repeated;
-    char * Method;
+        if (Length >= Bits) {
+            return DenyEntry(Network);
+        }
 
-    // Ensure we are dealing with SSH
-    SSHd = strstr(Line, " sshd[");
-    if (SSHd == 0) {
-        return false;
-    }
+        Mask.s_addr = (Length == 0 ? 0 : htonl(~0U << (Bits - Length)));
+        inet_ntop(AF_INET, &Mask, Buffer, sizeof(Buffer));
 
-    // Was message repeated
-    Repeated = strstr(SSHd, ": message repeated ");
-    if (Repeated == 0) {
-        return false;
+        return "sshd: " + Network + "/" + Buffer + "\n";
     }
 
-    // Get the failed method
-    Method = strstr(Repeated, " times: [ Failed ");
-    if (Method == 0) {
-        return false;
+    static void ToSockAddr(const std::string & Host, SockAddr & Address) {
+        memset(&Address, 0, sizeof(Address));
+        Address.sin_family = AF_INET;
+        inet_pton(AF_INET, Host.c_str(), &(Address.sin_addr));
     }
-    Method += sizeof(" times: [ Failed ");
-
-    // Advance to the number to extract it
-    Repeated += sizeof(": message repeated ") - sizeof(char);
-    Attempts = strtoul(Repeated, 0, 10);
+};
 
-    // Extract all the rest
-    return ExtractData(Method, Address, AddressLength);
-}
+struct IPv6 {
+    typedef struct in6_addr Binary;
+    typedef struct sockaddr_in6 SockAddr;
 
-static bool IsValidLine(char * Line, char ** Address,
-                        size_t & AddressLength, long unsigned int & Attempts) {
-    char * SSHd;
-    char * Method;
+    static const int Family = AF_INET6;
+    static const char Separator = ':';
+    static const unsigned int Bits = 128;
 
-    // Ensure we are dealing with SSH
-    SSHd = strstr(Line, " sshd[");
-    if (SSHd == 0) {
-        return false;
+    // Link-local addresses come with their zone (fe80::1%eth0)
+    // inet_pton() doesn't know about it, so validate without
+    static const char * AddressEnd(const char * Host, const char * End) {
+        const char * Zone = static_cast<const char *>(memchr(Host, '%', (End - Host)));
+        return (Zone != 0 ? Zone : End);
     }
 
-    // That the auth failed
-    Method = strstr(SSHd, ": Failed ");
-    if (Method == 0) {
-        // We might face message repeated - have a try
-        return IsMessageRepeated(Line, Address, AddressLength, Attempts);
+    static std::string DenyEntry(const std::string & Host) {
+        // [] are only needed for IPv6
+        return "sshd: [" + Host + "]\n";
     }
-    Method += sizeof(": Failed ");
-
-    // By default, there was 1 attempt
-    Attempts = 1;
 
-    // Extract all the rest
-    return ExtractData(Method, Address, AddressLength);
-}
-
-static long unsigned int IsLastRepeated(char * Line) {
-    char * SSHd;
-    char * Times;
-    char * End;
+    static std::string DenyEntry(const std::string & Network, unsigned int Length) {
+        std::ostringstream Entry;
 
-    // Ensure we are dealing with SSH
-    SSHd = strstr(Line, " sshd[");
-    if (SSHd == 0) {
-        return 0;
-    }
+        if (Length >= Bits) {
+            return DenyEntry(Network);
+        }
 
-    // That the message was repeated
-    Times = strstr(SSHd, ": last message repeated ");
-    if (Times == 0) {
-        return 0;
+        Entry << "sshd: [" << Network << "]/" << Length << "\n";
+        return Entry.str();
     }
-    // We want the exact number
-    Times += sizeof(": last message repeated ") - sizeof(char);
 
-    // Ensure the complete line is correct
-    End = strstr(Times, " times");
-    if (End == 0) {
-        return 0;
+    static void ToSockAddr(const std::string & Host, SockAddr & Address) {
+        memset(&Address, 0, sizeof(Address));
+        Address.sin6_family = AF_INET6;
+        inet_pton(AF_INET6, Host.substr(0, Host.find('%')).c_str(), &(Address.sin6_addr));
     }
+};
 
-    return strtoul(Times, 0, 10);
-}
+// Only accept addresses from a single family
+// Ignore any other IPs not to interfere with other deamons
+template <typename Policy>
+struct Only {
+    static int Match(const char * Host, const char * End) {
+        if (memchr(Host, Policy::Separator, (End - Host)) == 0) {
+            return AF_UNSPEC;
+        }
 
-static void AddToDeny(const std::string & Host) {
-    std::string Entry;
+        if (!IsValidAddress<Policy>(Host, End)) {
+            return AF_UNSPEC;
+        }
 
-    pid_t Child = fork();
-    if (Child == -1 || Child > 0) {
-        // Parent or failure, do nothing
-        return;
+        return Policy::Family;
     }
+};
 
-    // Now, open hosts.deny
-    int Deny = open(DenyFile, O_WRONLY | O_APPEND);
-    if (Deny < 0) {
-        exit(EXIT_FAILURE);
-    }
+// Accept addresses from both families
+// First is tried first, so it has to be IPv6, given that
+// IPv4 mapped IPv6 addresses also contain dots
+template <typename First, typename Second>
+struct Either {
+    static int Match(const char * Host, const char * End) {
+        int Family = Only<First>::Match(Host, End);
+        if (Family != AF_UNSPEC) {
+            return Family;
+        }
 
-    // Write the new entry
-#ifdef WITH_IPV4
-    // [] are only needed for IPv6
-    bool IsIPv6 = (Host.find(':') != std::string::npos);
-    if (IsIPv6) {
-        Entry = "sshd: [" + Host + "]\n";
-    } else {
-        Entry = "sshd: " + Host + "\n";
+        return Only<Second>::Match(Host, End);
     }
-#else
-    Entry = "sshd: [" + Host + "]\n";
-#endif
-    soft_assert(write(Deny, Entry.c_str(), Entry.length()) ==
-                (ssize_t)Entry.length());
+};
 
-    close(Deny);
-    sync();
+// What follows a literal in a rule
+enum Capture {
+    CaptureNothing,
+    CaptureAny,
+    CaptureHost,
+    CaptureCount,
+    CaptureSession
+};
 
-#ifndef WITHOUT_EMAIL
-    // Look up the IP address
-    union {
-#ifdef WITH_IPV4
-        struct sockaddr_in in;
-#endif
-        struct sockaddr_in6 in6;
-        struct sockaddr sa;
-    } SockAddr;
+// A literal id, and what lies right after it
+struct Step {
+    unsigned int Literal;
+    Capture      Follows;
+};
 
-#ifdef WITH_IPV4
-    if (!IsIPv6) {
-        inet_pton(AF_INET, Host.c_str(), &(SockAddr.in.sin_addr));
-        SockAddr.in.sin_family = AF_INET;
-    } else {
-#endif
-        inet_pton(AF_INET6, Host.c_str(), &(SockAddr.in6.sin6_addr));
-        SockAddr.in6.sin6_family = AF_INET6;
-#ifdef WITH_IPV4
-    }
-#endif
+struct Rule {
+    std::string       Name;
+    // Its steps, in order, in Matcher::Steps
+    size_t            First;
+    size_t            Count;
+    // The step followed by %{host}, Count if none
+    size_t            HostStep;
+    // Attempts counted per failure, 0 to only count hits
+    long unsigned int Weight;
+    // Only counted if its session didn't count a failure yet
+    bool              Once;
+    long unsigned int Hits;
+
+    Rule(const std::string & RuleName, size_t FirstStep, size_t Steps, size_t Host,
+         long unsigned int RuleWeight, bool OncePerSession)
+      : Name(RuleName), First(FirstStep), Count(Steps), HostStep(Host),
+        Weight(RuleWeight), Once(OncePerSession), Hits(0) {}
+};
 
-    char Name[NI_MAXHOST] = "";
-    if (getnameinfo(&SockAddr.sa, sizeof(SockAddr), Name, NI_MAXHOST, NULL, 0, 0) != 0)
-    {
-        snprintf(Name, NI_MAXHOST, "%s", "Unknown");
-    }
+// All the rules literals compiled into a single Aho-Corasick
+// automaton. Its transitions are fully computed (DFA) so that a line
+// is matched against all the rules in a single pass, one lookup per char
+struct Matcher {
+    std::vector<Rule>         Rules;
+    std::vector<Step>         Steps;
+    std::vector<std::string>  Literals;
+    // States * 256 transitions
+    std::vector<unsigned int> Delta;
+    // Literals ending in each state: OutputIds[OutputFirst[s]..OutputFirst[s + 1]]
+    std::vector<unsigned int> OutputFirst;
+    std::vector<unsigned int> OutputIds;
+    // Per line scan results: start positions of each literal
+    std::vector<std::vector<size_t> > Hits;
+    std::vector<unsigned int> Touched;
+    // Where the steps of the rule being checked were found
+    std::vector<size_t>       Starts;
+};
 
-    // Send the mail
-    FILE *Mailer = popen(MailCommand, "w");
-    if (Mailer) {
-        fprintf(Mailer, "Added the following hosts to /etc/hosts.deny:\n\n%s "
-                        "(%s)\n\n--------------------------------------------"
-                        "-------------------------", Host.c_str(), Name);
-        pclose(Mailer);
+static Matcher Failures;
+
+// Same as the patterns that used to be hardcoded, plus a few more
+// Used when the rules file is missing
+static char const * const DefaultRules[] = {
+    "failed              sshd[%{session}]: Failed %{*} for %{*} from %{host} port %{*}",
+    "repeated            sshd[%{session}]: message repeated %{count} times: [ Failed %{*} for %{*} from %{host} port %{*}",
+    "last-repeated       sshd[%{session}]: last message repeated %{count} times",
+    "invalid-user        sshd[%{session}]: Invalid user %{*} from %{host} port %{*}",
+    "preauth-closed:once sshd[%{session}]: Connection closed by authenticating user %{*} %{host} port %{*} [preauth]",
+    "max-auth:once       sshd[%{session}]: error: maximum authentication attempts exceeded for %{*} from %{host} port %{*}",
+};
+
+static unsigned int AddLiteral(Matcher & Compiled, const std::string & Literal) {
+    std::vector<std::string>::iterator it = std::find(Compiled.Literals.begin(),
+                                                      Compiled.Literals.end(), Literal);
+    if (it != Compiled.Literals.end()) {
+        return (unsigned int)(it - Compiled.Literals.begin());
     }
-#endif
 
-    // We are done here
-    exit(EXIT_SUCCESS);
+    Compiled.Literals.push_back(Literal);
+    return (unsigned int)(Compiled.Literals.size() - 1);
 }
 
-static bool UpdateHost(const std::string & Host,
-                       std::vector<HostIP> & Hosts,
-                       long unsigned int Repeated) {
-    bool InsertRequired = true;
-
-    soft_assert(!Host.empty());
-
-    for (std::vector<HostIP>::iterator it = Hosts.begin();
-         it != Hosts.end(); ++it) {
-        if ((*it).Address.compare(Host) == 0) {
-            InsertRequired = false;
-
-            (*it).Attempts += Repeated;
-
-            if ((*it).Attempts >= MaxAttempts && !(*it).Written) {
-                // Max attempts
-                // Add to hosts.deny
-                AddToDeny((*it).Address);
-                // Postpone a bit its expire so that it's still valid
-                // if we have further events in log to process
-                // It will get pruned later on when its expire date is gone
-                (*it).Expire += 60;
-                (*it).Written = true;
-            } else {
-                // Update expire
-                (*it).Expire += (Repeated * FailurePenalty * 60);
-            }
+// A rule is "<name>[:<weight>][:once] <pattern>". The pattern is literal
+// text with placeholders: %{host} for the address, %{count} for the number
+// of attempts, %{session} for what tells connections apart (the pid of
+// sshd) and %{*} for anything. %% stands for %.
+// A rule without %{host} repeats the last failure %{count} times.
+// Each failure counts as weight attempts, 1 by default. With once, the
+// rule needs %{session} and only counts if the session didn't yet.
+static bool ParseRule(const std::string & Line, Matcher & Compiled) {
+    size_t NameEnd = Line.find_first_of(" \t");
+    if (NameEnd == std::string::npos) {
+        return false;
+    }
 
-            break;
-        }
+    std::string Name = Line.substr(0, NameEnd);
+    long unsigned int Weight = 1;
+    bool Once = false;
+    size_t OnceBegin = Name.rfind(":once");
+    if (OnceBegin != std::string::npos && OnceBegin + 5 == Name.length()) {
+        Once = true;
+        Name.erase(OnceBegin);
     }
 
-    soft_assert((InsertRequired && Repeated == 1) || !InsertRequired);
+    size_t WeightBegin = Name.find(':');
+    if (WeightBegin != std::string::npos) {
+        std::string Digits = Name.substr(WeightBegin + 1);
+        if (Digits.empty() || Digits.length() > 3 ||
+            Digits.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
 
-    return InsertRequired;
-}
+        Weight = strtoul(Digits.c_str(), NULL, 10);
+        Name.erase(WeightBegin);
+    }
 
-static void ReadLine(int File, std::vector<HostIP> & Hosts) {
-    char Line[255];
-    char * Address;
-    std::string Host;
-    static std::string LastAddress = "";
-    size_t AddressLength;
-    ssize_t Length;
+    size_t Begin = Line.find_first_not_of(" \t", NameEnd);
+    if (Begin == std::string::npos) {
+        return false;
+    }
 
-    for (;;) {
-        unsigned int Read = 0;
-        long unsigned int Repeated = 1;
-
-        while (Read < sizeof(Line) / sizeof(char)) {
-            Length = read(File, &Line[Read], sizeof(char));
-            if (Length < 1) {
-                // If read failed while nothing was read yet
-                // there was nothing to read, break out
-                if (Read == 0) {
-                    return;
-                // Otherwise, it is the end of the file
-                } else {
-                    break;
-                }
+    std::vector<Step> Steps;
+    std::string Literal;
+    Capture Pending = CaptureNothing;
+    size_t HostStep = std::string::npos;
+    bool HasHost = false;
+    bool HasCount = false;
+    bool HasSession = false;
+
+    for (size_t Current = Begin; Current <= Line.length(); ++Current) {
+        Capture Found = CaptureNothing;
+
+        if (Current < Line.length() && Line.compare(Current, 2, "%%") == 0) {
+            Literal += '%';
+            ++Current;
+            continue;
+        } else if (Current < Line.length() && Line.compare(Current, 2, "%{") == 0) {
+            size_t End = Line.find('}', Current);
+            if (End == std::string::npos) {
+                return false;
             }
 
-            // Ensure lines are read one by one
-            if (Line[Read] == '\n') {
-                Line[Read] = '\0';
-                break;
+            std::string Placeholder = Line.substr(Current + 2, End - Current - 2);
+            if (Placeholder == "host") {
+                Found = CaptureHost;
+            } else if (Placeholder == "count") {
+                Found = CaptureCount;
+            } else if (Placeholder == "session") {
+                Found = CaptureSession;
+            } else if (Placeholder == "*") {
+                Found = CaptureAny;
+            } else {
+                return false;
             }
+            Current = End;
+        } else if (Current < Line.length()) {
+            Literal += Line[Current];
+            continue;
+        }
 
-            // Increase buffer position
-            Read++;
+        // Placeholder or end of pattern, flush the literal
+        if (!Literal.empty()) {
+            Step Next = {AddLiteral(Compiled, Literal), CaptureNothing};
+            Steps.push_back(Next);
+            Literal.clear();
+            Pending = CaptureNothing;
+        } else if (Found != CaptureNothing && Pending != CaptureNothing) {
+            // Two placeholders in a row cannot be told apart
+            return false;
         }
 
-        // Check if line is valid and if it is a repetition
-        if (!IsValidLine(Line, &Address, AddressLength, Repeated)) {
-            if (!LastAddress.empty()) {
-                Repeated = IsLastRepeated(Line);
-                if (Repeated == 0) {
-                    LastAddress = "";
-                    continue;
-                }
-            } else {
-                LastAddress = "";
-                continue;
+        if (Found == CaptureNothing) {
+            continue;
+        }
+
+        if (Steps.empty()) {
+            // Patterns are searched anywhere in the line
+            // so leading %{*} is implied, nothing else is allowed
+            if (Found != CaptureAny) {
+                return false;
             }
-        } else {
-            // Get the host
-            Host = Address;
-            Host.erase(AddressLength);
+            continue;
+        }
+
+        if ((Found == CaptureHost && HasHost) || (Found == CaptureCount && HasCount) ||
+            (Found == CaptureSession && HasSession)) {
+            return false;
+        }
 
-            // Save the host
-            LastAddress = Host;
+        if (Found == CaptureHost) {
+            HostStep = Steps.size() - 1;
+            HasHost = true;
         }
+        HasCount = (HasCount || Found == CaptureCount);
+        HasSession = (HasSession || Found == CaptureSession);
+        Steps.back().Follows = Found;
+        Pending = Found;
+    }
 
-        if (UpdateHost(LastAddress, Hosts, Repeated)) {
-            // Insert new host
-            Hosts.push_back(HostIP(time(0), Host, Repeated, (Repeated >= MaxAttempts)));
+    // A rule has to count some failure
+    if (Steps.empty() || (!HasHost && !HasCount) || (Once && !HasSession)) {
+        return false;
+    }
+
+    Compiled.Rules.push_back(Rule(Name, Compiled.Steps.size(), Steps.size(),
+                                  (HasHost ? HostStep : Steps.size()), Weight, Once));
+    Compiled.Steps.insert(Compiled.Steps.end(), Steps.begin(), Steps.end());
+    return true;
+}
 
-            // Already deny if there were too many instances in a row
-            if (Repeated >= MaxAttempts) {
-                AddToDeny(LastAddress);
+static void CompileMatcher(Matcher & Compiled) {
+    static unsigned int const None = ~0U;
+    std::vector<unsigned int> Fail;
+    std::vector<std::vector<unsigned int> > Outputs;
+
+    // Build the trie, transitions to come are marked None
+    Compiled.Delta.assign(256, None);
+    Outputs.resize(1);
+    for (unsigned int Id = 0; Id < Compiled.Literals.size(); ++Id) {
+        const std::string & Literal = Compiled.Literals[Id];
+        unsigned int State = 0;
+
+        for (size_t Char = 0; Char < Literal.length(); ++Char) {
+            size_t Next = State * 256 + (unsigned char)Literal[Char];
+            if (Compiled.Delta[Next] == None) {
+                Compiled.Delta[Next] = (unsigned int)Outputs.size();
+                Compiled.Delta.resize(Compiled.Delta.size() + 256, None);
+                Outputs.resize(Outputs.size() + 1);
             }
+            State = Compiled.Delta[Next];
         }
 
-        // In any case, resort list
-        // An item can have been added, expire modified, or an item deleted
-        sort(Hosts.begin(), Hosts.end(), Closer());
+        Outputs[State].push_back(Id);
     }
-}
 
-int main(int argc, char ** argv) {
-    std::vector<HostIP> Hosts;
-    struct sigaction SigHandling;
+    // Then, breadth first, compute failure links and turn
+    // missing transitions into the ones of the failure state
+    std::vector<unsigned int> Queue;
+    Fail.assign(Outputs.size(), 0);
+    for (unsigned int Char = 0; Char < 256; ++Char) {
+        if (Compiled.Delta[Char] == None) {
+            Compiled.Delta[Char] = 0;
+        } else {
+            Queue.push_back(Compiled.Delta[Char]);
+        }
+    }
 
-    unreferenced_parameter(argc);
-    unreferenced_parameter(argv);
+    for (size_t Current = 0; Current < Queue.size(); ++Current) {
+        unsigned int State = Queue[Current];
+        unsigned int Failure = Fail[State];
 
-    memset(&SigHandling, 0, sizeof(struct sigaction));
-    SigHandling.sa_handler = SignalHandler;
+        // Shallower states are complete already
+        Outputs[State].insert(Outputs[State].end(), Outputs[Failure].begin(), Outputs[Failure].end());
 
-    // Install signals handler
-    if (sigaction(SIGTERM, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+        for (unsigned int Char = 0; Char < 256; ++Char) {
+            unsigned int & Next = Compiled.Delta[State * 256 + Char];
+            if (Next == None) {
+                Next = Compiled.Delta[Failure * 256 + Char];
+            } else {
+                Fail[Next] = Compiled.Delta[Failure * 256 + Char];
+                Queue.push_back(Next);
+            }
+        }
     }
 
-    if (sigaction(SIGINT, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+    // Flatten outputs
+    Compiled.OutputFirst.clear();
+    Compiled.OutputIds.clear();
+    for (size_t State = 0; State < Outputs.size(); ++State) {
+        Compiled.OutputFirst.push_back((unsigned int)Compiled.OutputIds.size());
+        Compiled.OutputIds.insert(Compiled.OutputIds.end(), Outputs[State].begin(), Outputs[State].end());
     }
-
-    if (sigaction(SIGQUIT, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+    Compiled.OutputFirst.push_back((unsigned int)Compiled.OutputIds.size());
+
+    Compiled.Hits.assign(Compiled.Literals.size(), std::vector<size_t>());
+    Compiled.Touched.clear();
+    Compiled.Starts.clear();
+    for (std::vector<Rule>::const_iterator it = Compiled.Rules.begin();
+         it != Compiled.Rules.end(); ++it) {
+        Compiled.Starts.resize(std::max(Compiled.Starts.size(), (*it).Count));
     }
+}
 
-    memset(&SigHandling, 0, sizeof(struct sigaction));
-    SigHandling.sa_sigaction = ExceptionHandler;
-    SigHandling.sa_flags = SA_SIGINFO | SA_RESETHAND;
+static void LoadRules(Matcher & Compiled) {
+    std::ifstream File(RulesFile);
+    std::string Line;
+    unsigned int Number = 0;
+    std::map<std::string, long unsigned int> Hits;
 
-    // Install exceptions handler
-    if (sigaction(SIGABRT, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+    // Rules keep their hits across reloads, as long as their name
+    for (std::vector<Rule>::const_iterator it = Compiled.Rules.begin();
+         it != Compiled.Rules.end(); ++it) {
+        Hits[(*it).Name] = (*it).Hits;
     }
 
-    if (sigaction(SIGBUS, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
-    }
+    Compiled.Rules.clear();
+    Compiled.Steps.clear();
+    Compiled.Literals.clear();
 
-    if (sigaction(SIGFPE, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
-    }
+    while (std::getline(File, Line)) {
+        ++Number;
 
-    if (sigaction(SIGILL, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
-    }
+        // Skip comments and empty lines
+        size_t First = Line.find_first_not_of(" \t\r");
+        if (First == std::string::npos || Line[First] == '#') {
+            continue;
+        }
 
-    if (sigaction(SIGSEGV, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+        Line = Line.substr(First, Line.find_last_not_of(" \t\r") + 1 - First);
+        if (!ParseRule(Line, Compiled)) {
+            syslog(LOG_NOTICE, "Invalid rule at line %u in file %s", Number, RulesFile);
+        }
     }
 
-    if (sigaction(SIGSYS, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
-    }
+    // Never run without any rule
+    if (Compiled.Rules.empty()) {
+        syslog(LOG_NOTICE, "No rule loaded from %s, using defaults", RulesFile);
 
-    if (sigaction(SIGXCPU, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+        for (size_t Default = 0; Default < sizeof(DefaultRules) / sizeof(DefaultRules[0]); ++Default) {
+            hard_assert(ParseRule(DefaultRules[Default], Compiled));
+        }
     }
 
-    if (sigaction(SIGXFSZ, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
+    for (std::vector<Rule>::iterator it = Compiled.Rules.begin();
+         it != Compiled.Rules.end(); ++it) {
+        std::map<std::string, long unsigned int>::const_iterator Kept = Hits.find((*it).Name);
+        if (Kept != Hits.end()) {
+            (*it).Hits = (*Kept).second;
+        }
     }
 
-    // Prevent zombies
-    SigHandling.sa_handler = NULL;
-    SigHandling.sa_flags = SA_NOCLDWAIT;
-    if (sigaction(SIGCHLD, &SigHandling, NULL) < 0) {
-        std::cerr << "Failed to install signal handler" << std::endl;
-        exit(EXIT_FAILURE);
-    }
+    CompileMatcher(Compiled);
+}
 
-    syslog(LOG_INFO, "Daemon starting up");
-    setlogmask(LOG_MASK(LOG_INFO) | LOG_MASK(LOG_CRIT) | LOG_MASK(LOG_NOTICE));
-    openlog("ForbidHosts", LOG_CONS, LOG_USER);
+struct LineMatch {
+    Rule *            Matched;
+    // AF_UNSPEC when the last failure is repeated
+    int               Family;
+    const char *      Address;
+    size_t            AddressLength;
+    // Empty when the rule has no %{session}
+    const char *      Session;
+    size_t            SessionLength;
+    long unsigned int Attempts;
+};
 
-    // Start deamon
-    pid_t Deamon = fork();
-    if (Deamon < 0) {
-        exit(EXIT_FAILURE);
-    }
+// Places the steps [From, To) of a rule, each at the first
+// occurrence of its literal after the previous one
+static bool PlaceSteps(Matcher & Compiled, const Rule & Current,
+                       size_t From, size_t To, size_t Cursor) {
+    for (size_t Literal = From; Literal < To; ++Literal) {
+        unsigned int Id = Compiled.Steps[Current.First + Literal].Literal;
+        const std::vector<size_t> & Positions = Compiled.Hits[Id];
+
+        std::vector<size_t>::const_iterator Found = std::lower_bound(Positions.begin(),
+                                                                     Positions.end(), Cursor);
+        if (Found == Positions.end()) {
+            return false;
+        }
 
-    if (Deamon > 0) {
-        exit(EXIT_SUCCESS);
+        Compiled.Starts[Literal] = *Found;
+        Cursor = *Found + Compiled.Literals[Id].length();
     }
 
-    // Quit session
-    umask(0);
-    if (setsid() < 0) {
-        exit(EXIT_FAILURE);
-    }
+    return true;
+}
 
-    // Go back to root
-    if ((chdir("/")) < 0) {
-        exit(EXIT_FAILURE);
+// Finds the first rule matching the line
+// All the literals are found in a single pass, rules are then
+// checked against the positions found, first match wins
+template <typename Policy>
+static bool MatchRules(const char * Line, size_t Length, LineMatch & Result) {
+    Matcher & Compiled = Failures;
+    unsigned int State = 0;
+
+    for (std::vector<unsigned int>::const_iterator it = Compiled.Touched.begin();
+         it != Compiled.Touched.end(); ++it) {
+        Compiled.Hits[*it].clear();
     }
+    Compiled.Touched.clear();
 
-    // Get rid of useless descriptors
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+    for (size_t Char = 0; Char < Length; ++Char) {
+        State = Compiled.Delta[State * 256 + (unsigned char)Line[Char]];
 
-#ifndef WITHOUT_EMAIL
-    // Get our hostname
-    {
-        char HostName[HOST_NAME_MAX + 1];
-        if (gethostname(HostName, sizeof(HostName)) < 0) {
-            exit(EXIT_FAILURE);
+        for (unsigned int Output = Compiled.OutputFirst[State];
+             Output < Compiled.OutputFirst[State + 1]; ++Output) {
+            unsigned int Id = Compiled.OutputIds[Output];
+            if (Compiled.Hits[Id].empty()) {
+                Compiled.Touched.push_back(Id);
+            }
+            Compiled.Hits[Id].push_back(Char + 1 - Compiled.Literals[Id].length());
         }
-
-        sprintf(MailCommand, MailCommandTpl, HostName);
-        sprintf(CrashMail, CrashMailTpl, HostName);
     }
-#endif
 
-    int AuthLog = open(AuthLogFile, O_RDONLY | O_NONBLOCK);
-    if (AuthLog < 0) {
-        exit(EXIT_FAILURE);
+    if (Compiled.Touched.empty()) {
+        return false;
     }
 
-    // Only take care of new entries
-    lseek(AuthLog, 0, SEEK_END);
+    for (std::vector<Rule>::iterator it = Compiled.Rules.begin();
+         it != Compiled.Rules.end(); ++it) {
+        Rule & Current = *it;
+        const char * HostBegin = 0;
+        const char * HostEnd = 0;
+        const char * CountBegin = 0;
+        const char * CountEnd = 0;
+        const char * SessionBegin = 0;
+        const char * SessionEnd = 0;
+
+        if (!PlaceSteps(Compiled, Current, 0, std::min(Current.HostStep, Current.Count), 0)) {
+            continue;
+        }
+
+        if (Current.HostStep < Current.Count) {
+            // What precedes the host may come from the client (user name...)
+            // while the host is written after it by the server. So the literal
+            // before the host is taken at its last occurrence from which
+            // the rest of the rule still matches
+            const Step & Before = Compiled.Steps[Current.First + Current.HostStep];
+            const std::vector<size_t> & Positions = Compiled.Hits[Before.Literal];
+            size_t Skip = Compiled.Literals[Before.Literal].length();
+            size_t Cursor = 0;
+            bool Placed = false;
+
+            if (Current.HostStep > 0) {
+                const Step & Previous = Compiled.Steps[Current.First + Current.HostStep - 1];
+                Cursor = Compiled.Starts[Current.HostStep - 1] + Compiled.Literals[Previous.Literal].length();
+            }
+
+            for (std::vector<size_t>::const_reverse_iterator Found = Positions.rbegin();
+                 Found != Positions.rend() && *Found >= Cursor; ++Found) {
+                Compiled.Starts[Current.HostStep] = *Found;
+
+                // The host cannot be empty
+                if (PlaceSteps(Compiled, Current, Current.HostStep + 1, Current.Count, *Found + Skip + 1)) {
+                    Placed = true;
+                    break;
+                }
+            }
+
+            if (!Placed) {
+                continue;
+            }
+        }
+
+        // Captures go from the end of their literal to the start of the next one
+        for (size_t Literal = 0; Literal < Current.Count; ++Literal) {
+            const Step & Next = Compiled.Steps[Current.First + Literal];
+            const char * Begin = Line + Compiled.Starts[Literal] + Compiled.Literals[Next.Literal].length();
+            const char * End = 0;
+
+            if (Literal + 1 < Current.Count) {
+                End = Line + Compiled.Starts[Literal + 1];
+            }
+
+            if (Next.Follows == CaptureHost) {
+                HostBegin = Begin;
+                HostEnd = End;
+            } else if (Next.Follows == CaptureCount) {
+                CountBegin = Begin;
+                CountEnd = End;
+            } else if (Next.Follows == CaptureSession) {
+                SessionBegin = Begin;
+                SessionEnd = End;
+            }
+        }
+
+        // Trailing capture goes up to the next blank
+        if (HostBegin != 0 && HostEnd == 0) {
+            HostEnd = HostBegin;
+            while (HostEnd < Line + Length && !isspace((unsigned char)*HostEnd)) {
+                ++HostEnd;
+            }
+        }
+
+        if (CountBegin != 0 && CountEnd == 0) {
+            CountEnd = CountBegin;
+            while (CountEnd < Line + Length && !isspace((unsigned char)*CountEnd)) {
+                ++CountEnd;
+            }
+        }
+
+        if (SessionBegin != 0 && SessionEnd == 0) {
+            SessionEnd = SessionBegin;
+            while (SessionEnd < Line + Length && !isspace((unsigned char)*SessionEnd)) {
+                ++SessionEnd;
+            }
+        }
+
+        // By default, there was 1 attempt
+        Result.Attempts = 1;
+        if (CountBegin != 0) {
+            if (CountBegin == CountEnd || CountEnd - CountBegin > 9) {
+                continue;
+            }
+
+            Result.Attempts = 0;
+            for (const char * Digit = CountBegin; Digit < CountEnd; ++Digit) {
+                if (!isdigit((unsigned char)*Digit)) {
+                    Result.Attempts = 0;
+                    break;
+                }
+                Result.Attempts = Result.Attempts * 10 + (long unsigned int)(*Digit - '0');
+            }
+
+            if (Result.Attempts == 0) {
+                continue;
+            }
+        }
+
+        Result.Attempts *= Current.Weight;
+
+        Result.Family = AF_UNSPEC;
+        if (Current.HostStep < Current.Count) {
+            // Finaly, ensure we have an address we care about
+            Result.Family = Policy::Match(HostBegin, HostEnd);
+            if (Result.Family == AF_UNSPEC) {
+                continue;
+            }
+
+            Result.Address = HostBegin;
+            Result.AddressLength = (HostEnd - HostBegin);
+        }
+
+        Result.Session = SessionBegin;
+        Result.SessionLength = (SessionEnd - SessionBegin);
+        Result.Matched = &Current;
+        return true;
+    }
+
+    return false;
+}
+
+typedef bool (*LineMatcher)(const char * Line, size_t Length, LineMatch & Result);
+
+// Selected at startup given the enabled families
+static LineMatcher MatchLine = MatchRules<Only<IPv6> >;
+
+// Parses "address", "address/length" or "address/netmask" (IPv4)
+// IPv6 addresses might be enclosed in [], as in hosts.deny
+// Host bits are cleared, so that networks compare easily
+static bool ParsePrefix(const std::string & Text, Prefix & Network) {
+    std::string Address = Text;
+    std::string Mask;
+    unsigned int Bits;
+
+    size_t Slash = Text.find('/');
+    if (Slash != std::string::npos) {
+        Address = Text.substr(0, Slash);
+        Mask = Text.substr(Slash + 1);
+        if (Mask.empty()) {
+            return false;
+        }
+    }
+
+    if (Address.length() > 2 && Address[0] == '[' && Address[Address.length() - 1] == ']') {
+        Address = Address.substr(1, Address.length() - 2);
+    }
+
+    memset(&Network, 0, sizeof(Network));
+    if (Address.find(':') != std::string::npos) {
+        // Hosts are tracked without their zone
+        Address = Address.substr(0, Address.find('%'));
+        Network.Family = AF_INET6;
+        Bits = IPv6::Bits;
+    } else {
+        Network.Family = AF_INET;
+        Bits = IPv4::Bits;
+    }
+
+    if (inet_pton(Network.Family, Address.c_str(), Network.Address) != 1) {
+        return false;
+    }
+
+    Network.Length = Bits;
+    if (!Mask.empty()) {
+        if (Mask.find_first_not_of("0123456789") == std::string::npos) {
+            if (Mask.length() > 3) {
+                return false;
+            }
+
+            Network.Length = (unsigned int)strtoul(Mask.c_str(), 0, 10);
+            if (Network.Length > Bits) {
+                return false;
+            }
+        } else if (Network.Family == AF_INET) {
+            unsigned char Netmask[sizeof(struct in_addr)];
+            bool Contiguous = true;
+
+            if (inet_pton(AF_INET, Mask.c_str(), Netmask) != 1) {
+                return false;
+            }
+
+            // Count the leading ones, and make sure nothing follows
+            Network.Length = 0;
+            for (unsigned int Bit = 0; Bit < Bits; ++Bit) {
+                bool Set = ((Netmask[Bit / 8] & (0x80 >> (Bit % 8))) != 0);
+                if (Set && !Contiguous) {
+                    return false;
+                }
+
+                if (Set) {
+                    ++Network.Length;
+                } else {
+                    Contiguous = false;
+                }
+            }
+        } else {
+            return false;
+        }
+    }
+
+    // Clear host bits
+    for (unsigned int Bit = Network.Length; Bit < Bits; ++Bit) {
+        Network.Address[Bit / 8] &= (unsigned char)~(0x80 >> (Bit % 8));
+    }
+
+    return true;
+}
+
+static bool InPrefix(const Prefix & Network, const Prefix & Host) {
+    if (Network.Family != Host.Family || Network.Length > Host.Length) {
+        return false;
+    }
+
+    for (unsigned int Bit = 0; Bit < Network.Length; ++Bit) {
+        unsigned char Mask = (unsigned char)(0x80 >> (Bit % 8));
+        if ((Network.Address[Bit / 8] & Mask) != (Host.Address[Bit / 8] & Mask)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::string FormatAddress(const Prefix & Network) {
+    char Buffer[INET6_ADDRSTRLEN];
+
+    inet_ntop(Network.Family, Network.Address, Buffer, sizeof(Buffer));
+    return Buffer;
+}
+
+static std::string DenyEntry(const Prefix & Network) {
+    if (Network.Family == AF_INET) {
+        return IPv4::DenyEntry(FormatAddress(Network), Network.Length);
+    }
+
+    return IPv6::DenyEntry(FormatAddress(Network), Network.Length);
+}
+
+// Only consider entries as we write them: "sshd: <one prefix>"
+static bool ParseDenyEntry(const std::string & Line, Prefix & Network) {
+    if (Line.compare(0, sizeof("sshd: ") - sizeof(char), "sshd: ") != 0) {
+        return false;
+    }
+
+    return ParsePrefix(Line.substr(sizeof("sshd: ") - sizeof(char)), Network);
+}
+
+// Open hosts.deny and lock it
+// Make sure the lock is held on the file currently in place
+// and not on one that got replaced while we were waiting
+static int OpenDeny(int Flags) {
+    struct stat Opened;
+    struct stat Current;
+
+    for (;;) {
+        int Deny = open(DenyFile, Flags);
+        if (Deny < 0) {
+            return -1;
+        }
+
+        if (flock(Deny, LOCK_EX) < 0 || fstat(Deny, &Opened) < 0) {
+            close(Deny);
+            return -1;
+        }
+
+        if (stat(DenyFile, &Current) == 0 &&
+            Opened.st_dev == Current.st_dev && Opened.st_ino == Current.st_ino) {
+            return Deny;
+        }
+
+        close(Deny);
+    }
+}
+
+static bool ReadDeny(int Deny, std::string & Content) {
+    char Buffer[4096];
+    ssize_t Length;
+
+    while ((Length = read(Deny, Buffer, sizeof(Buffer))) > 0) {
+        Content.append(Buffer, (size_t)Length);
+    }
+
+    return (Length == 0);
+}
+
+// Whether an entry already covers the network
+static bool InDeny(const std::string & Content, const Prefix & Network) {
+    size_t Begin = 0;
+
+    while (Begin < Content.length()) {
+        size_t End = Content.find('\n', Begin);
+        End = (End == std::string::npos ? Content.length() : End);
+
+        std::string Entry = Content.substr(Begin, End - Begin);
+        Entry.erase(Entry.find_last_not_of("\r") + 1);
+        Prefix Denied;
+        if (ParseDenyEntry(Entry, Denied) && InPrefix(Denied, Network)) {
+            return true;
+        }
+
+        Begin = End + 1;
+    }
+
+    return false;
+}
+
+// Adds the entry for the network, unless it is already denied
+// Returns 1 if written, 0 if already there, -1 on failure
+static int AppendToDeny(const std::string & Entry, const Prefix & Network) {
+    std::string Content;
+
+    int Deny = OpenDeny(O_RDWR | O_APPEND);
+    if (Deny < 0) {
+        return -1;
+    }
+
+    if (!ReadDeny(Deny, Content)) {
+        close(Deny);
+        return -1;
+    }
+
+    if (InDeny(Content, Network)) {
+        close(Deny);
+        return 0;
+    }
+
+    bool Written = (write(Deny, Entry.c_str(), Entry.length()) ==
+                    (ssize_t)Entry.length());
+    soft_assert(Written);
+
+    close(Deny);
+    return (Written ? 1 : -1);
+}
+
+// Removes all the entries within the network
+// Returns the number of entries removed from hosts.deny, -1 on failure
+static int RemoveFromDeny(const Prefix & Network) {
+    std::string Content;
+    std::string Kept;
+    int Removed = 0;
+    struct stat Attributes;
+
+    int Deny = OpenDeny(O_RDONLY);
+    if (Deny < 0) {
+        return -1;
+    }
+
+    if (!ReadDeny(Deny, Content) || fstat(Deny, &Attributes) < 0) {
+        close(Deny);
+        return -1;
+    }
+
+    // Keep everything but the matching entries
+    size_t Begin = 0;
+    while (Begin < Content.length()) {
+        size_t End = Content.find('\n', Begin);
+        End = (End == std::string::npos ? Content.length() : End + 1);
+
+        std::string Line = Content.substr(Begin, End - Begin);
+        std::string Entry = Line.substr(0, Line.find_last_not_of("\r\n") + 1);
+        Prefix Denied;
+        if (ParseDenyEntry(Entry, Denied) && InPrefix(Network, Denied)) {
+            ++Removed;
+        } else {
+            Kept += Line;
+        }
+
+        Begin = End;
+    }
+
+    if (Removed == 0) {
+        close(Deny);
+        return 0;
+    }
+
+    // Write the new file aside and replace the old one
+    // while still holding the lock, so that no entry gets lost
+    std::string Temporary = std::string(DenyFile) + ".ForbidHosts";
+    int New = open(Temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, Attributes.st_mode & 07777);
+    if (New < 0) {
+        close(Deny);
+        return -1;
+    }
+
+    bool Written = (write(New, Kept.c_str(), Kept.length()) == (ssize_t)Kept.length());
+    soft_assert(fchown(New, Attributes.st_uid, Attributes.st_gid) == 0);
+    Written = (fsync(New) == 0 && Written);
+    close(New);
+
+    if (!Written || rename(Temporary.c_str(), DenyFile) < 0) {
+        unlink(Temporary.c_str());
+        close(Deny);
+        return -1;
+    }
+
+    close(Deny);
+    return Removed;
+}
+
+template <typename Policy>
+static void DenyHost(const std::string & Host, const Prefix & Network) {
+    pid_t Child = fork();
+    if (Child == -1 || Child > 0) {
+        // Parent or failure, do nothing
+        return;
+    }
+
+    // Don't leave the mailer with signals blocked
+    sigprocmask(SIG_UNBLOCK, &LoopSignals, NULL);
+
+    // Write the new entry to hosts.deny
+    // Nothing to do if it's already there, for instance in a banned network
+    int Written = AppendToDeny(Policy::DenyEntry(Host), Network);
+    if (Written < 0) {
+        exit(EXIT_FAILURE);
+    } else if (Written == 0) {
+        exit(EXIT_SUCCESS);
+    }
+
+    sync();
+
+#ifndef WITHOUT_EMAIL
+    // Look up the IP address
+    typename Policy::SockAddr SockAddr;
+    Policy::ToSockAddr(Host, SockAddr);
+
+    char Name[NI_MAXHOST] = "";
+    if (getnameinfo(reinterpret_cast<struct sockaddr *>(&SockAddr), sizeof(SockAddr),
+                    Name, NI_MAXHOST, NULL, 0, 0) != 0)
+    {
+        snprintf(Name, NI_MAXHOST, "%s", "Unknown");
+    }
+
+    // Send the mail
+    FILE *Mailer = popen(MailCommand, "w");
+    if (Mailer) {
+        fprintf(Mailer, "Added the following hosts to /etc/hosts.deny:\n\n%s "
+                        "(%s)\n\n--------------------------------------------"
+                        "-------------------------", Host.c_str(), Name);
+        pclose(Mailer);
+    }
+#endif
+
+    // We are done here
+    exit(EXIT_SUCCESS);
+}
+
+static void AddToDeny(const HostIP & Host) {
+    soft_assert(Host.Family == AF_INET || Host.Family == AF_INET6);
+
+    if (Host.Family == AF_INET) {
+        DenyHost<IPv4>(Host.Address, Host.Binary);
+    } else {
+        DenyHost<IPv6>(Host.Address, Host.Binary);
+    }
+}
+
+typedef void (*BanAction)(const HostIP & Host);
+
+// Replaced when replaying
+static BanAction Ban = AddToDeny;
+
+// Snapshots that still have to stream the host keep it as it was
+static void SaveHost(HostTable & Hosts, const HostIP & Host) {
+    for (std::list<Snapshot>::iterator it = Hosts.Snapshots.begin();
+         it != Hosts.Snapshots.end(); ++it) {
+        if (Host.Born > (*it).Generation ||
+            ((*it).Started && !AddressOrder()((*it).Cursor, Host.Binary))) {
+            continue;
+        }
+
+        // Only the first save is kept, that's the host as it was
+        (*it).Saved.insert(std::make_pair(Host.Binary, Host));
+    }
+}
+
+// Any change to a host happens between these two
+static void ChangingHost(HostTable & Hosts, const HostIP & Host) {
+    SaveHost(Hosts, Host);
+    Hosts.Expiries.erase(&Host);
+    Hosts.Ranks.erase(&Host);
+}
+
+static void ChangedHost(HostTable & Hosts, const HostIP & Host) {
+    Hosts.Expiries.insert(&Host);
+    Hosts.Ranks.insert(&Host);
+}
+
+static HostIP & AddHost(HostTable & Hosts, const HostIP & Host) {
+    HostIP & Added = (*Hosts.Tracked.insert(std::make_pair(Host.Binary, Host)).first).second;
+
+    Added.Born = Hosts.Generation;
+    ChangedHost(Hosts, Added);
+    return Added;
+}
+
+static void RemoveHost(HostTable & Hosts, HostMap::iterator Host) {
+    ChangingHost(Hosts, (*Host).second);
+    Hosts.Tracked.erase(Host);
+}
+
+// A host address, as logged (with its zone for IPv6 link-local ones)
+static void HostPrefix(int Family, const std::string & Address, Prefix & Host) {
+    memset(&Host, 0, sizeof(Host));
+    Host.Family = Family;
+    Host.Length = (Family == AF_INET ? IPv4::Bits : IPv6::Bits);
+    soft_assert(inet_pton(Family, Address.substr(0, Address.find('%')).c_str(), Host.Address) == 1);
+}
+
+static bool UpdateHost(const Prefix & Host, HostTable & Hosts,
+                       long unsigned int Repeated) {
+    HostMap::iterator Found = Hosts.Tracked.find(Host);
+    if (Found == Hosts.Tracked.end()) {
+        soft_assert(Repeated == 1);
+        return true;
+    }
+
+    HostIP & Current = (*Found).second;
+    ChangingHost(Hosts, Current);
+
+    Current.Attempts += Repeated;
+
+    if (Current.Attempts >= MaxAttempts && !Current.Written) {
+        // Max attempts
+        // Add to hosts.deny
+        Ban(Current);
+        // Postpone a bit its expire so that it's still valid
+        // if we have further events in log to process
+        // It will get pruned later on when its expire date is gone
+        Current.Expire += 60;
+        Current.Written = true;
+    } else {
+        // Update expire
+        Current.Expire += (Repeated * FailurePenalty * 60);
+    }
+
+    ChangedHost(Hosts, Current);
+    return false;
+}
+
+// Sessions, as "<session> <address>", that recently counted a failure
+// The oldest are forgotten first
+static std::set<std::string> CountedSessions;
+static std::deque<std::set<std::string>::iterator> SessionsAge;
+
+// Returns whether a failure of the session counts, and remembers it did
+static bool CountSession(const std::string & Session, bool Once) {
+    std::pair<std::set<std::string>::iterator, bool> Counted = CountedSessions.insert(Session);
+    if (!Counted.second) {
+        return !Once;
+    }
+
+    SessionsAge.push_back(Counted.first);
+    if (SessionsAge.size() > MaxSessions) {
+        CountedSessions.erase(SessionsAge.front());
+        SessionsAge.pop_front();
+    }
+
+    return true;
+}
+
+static void ProcessLine(const char * Line, size_t Length, HostTable & Hosts) {
+    LineMatch Result;
+    static std::string LastAddress = "";
+    static Prefix LastBinary;
+    static std::string Address;
+    long unsigned int Repeated;
+
+    // Check if line is valid and if it is a repetition
+    if (!MatchLine(Line, Length, Result)) {
+        LastAddress = "";
+        return;
+    }
+
+    // Lines that don't count aren't failures to repeat either
+    if (Result.Attempts == 0) {
+        ++Result.Matched->Hits;
+        LastAddress = "";
+        return;
+    }
+
+    Repeated = Result.Attempts;
+    if (Result.Family == AF_UNSPEC) {
+        if (LastAddress.empty()) {
+            return;
+        }
+        Address = LastAddress;
+    } else {
+        Address.assign(Result.Address, Result.AddressLength);
+    }
+
+    if (Result.SessionLength != 0) {
+        static std::string Session;
+        Session.assign(Result.Session, Result.SessionLength);
+        Session += ' ';
+        Session += Address;
+
+        // Follow-up of a failure already counted, neither it nor its
+        // repetitions count
+        if (!CountSession(Session, Result.Matched->Once)) {
+            LastAddress = "";
+            return;
+        }
+    }
+
+    if (Result.Family != AF_UNSPEC) {
+        // Save the host
+        LastAddress = Address;
+        HostPrefix(Result.Family, LastAddress, LastBinary);
+    }
+
+    // Only count the lines that made a difference
+    ++Result.Matched->Hits;
+
+    if (UpdateHost(LastBinary, Hosts, Repeated)) {
+        // Insert new host
+        HostIP & Added = AddHost(Hosts, HostIP(Now(), LastAddress, LastBinary, Repeated,
+                                               (Repeated >= MaxAttempts)));
+
+        // Already deny if there were too many instances in a row
+        if (Repeated >= MaxAttempts) {
+            Ban(Added);
+        }
+    }
+}
+
+// Splits what is read from a log into the lines given to ProcessLine
+struct LineSplitter {
+    char Line[MaxLine];
+    unsigned int Read;
+    bool Complete;
+    bool Skipping;
+
+    LineSplitter() : Read(0), Complete(false), Skipping(false) {}
+};
+
+// Returns whether Line holds a line to process once Byte is added
+static bool SplitLine(LineSplitter & Splitter, char Byte) {
+    // Start over after a line was given
+    if (Splitter.Complete) {
+        Splitter.Read = 0;
+        Splitter.Complete = false;
+    }
+
+    // Ensure lines are read one by one
+    if (Byte == '\n') {
+        Splitter.Complete = !Splitter.Skipping;
+        Splitter.Skipping = false;
+        return Splitter.Complete;
+    }
+
+    if (Splitter.Skipping) {
+        return false;
+    }
+
+    // Drop lines that don't fit, rather than matching their pieces
+    // separately: a long user name could otherwise start a piece with
+    // a forged failure
+    if (Splitter.Read == sizeof(Splitter.Line) / sizeof(char)) {
+        Splitter.Read = 0;
+        Splitter.Skipping = true;
+        return false;
+    }
+
+    Splitter.Line[Splitter.Read] = Byte;
+    Splitter.Read++;
+
+    return false;
+}
+
+// Returns whether Line holds a line to process at the end of the file
+static bool EndLine(LineSplitter & Splitter) {
+    if (Splitter.Complete) {
+        Splitter.Read = 0;
+        Splitter.Complete = false;
+    }
+
+    Splitter.Complete = (Splitter.Read != 0 && !Splitter.Skipping);
+    return Splitter.Complete;
+}
+
+// Returns whether anything was read
+static bool ReadLine(int File, HostTable & Hosts) {
+    bool Active = false;
+    LineSplitter Splitter;
+    char Byte;
+
+    while (read(File, &Byte, sizeof(char)) == 1) {
+        Active = true;
+
+        if (SplitLine(Splitter, Byte)) {
+            ProcessLine(Splitter.Line, Splitter.Read, Hosts);
+        }
+    }
+
+    if (EndLine(Splitter)) {
+        ProcessLine(Splitter.Line, Splitter.Read, Hosts);
+    }
+
+    return Active;
+}
+
+static void PurgeHosts(HostTable & Hosts) {
+    // Purge queue of expired hosts
+    while (!Hosts.Expiries.empty()) {
+        const HostIP * Soonest = *Hosts.Expiries.begin();
+        if (Soonest->Expire > Now()) {
+            break;
+        }
+
+        RemoveHost(Hosts, Hosts.Tracked.find(Soonest->Binary));
+    }
+}
+
+static int EventLoop = -1;
+
+static bool Watch(int Operation, int FD, unsigned int Events) {
+    struct epoll_event Event;
+
+    memset(&Event, 0, sizeof(Event));
+    Event.events = Events;
+    Event.data.fd = FD;
+
+    return (epoll_ctl(EventLoop, Operation, FD, &Event) == 0);
+}
+
+struct ControlClient {
+    int                           Socket;
+    std::string                   Input;
+    std::string                   Output;
+    // The snapshot being streamed to the client
+    std::list<Snapshot>::iterator Dump;
+    bool                          Streaming;
+    // Child changing hosts.deny for the request, its result comes from Job
+    int                           Job;
+    bool                          Banning;
+    Prefix                        Network;
+    std::string                   Argument;
+    // Once the job is done, the hosts of Network follow its Changed
+    // entries, a slice at a time, from after Cursor when Started
+    bool                          Applying;
+    int                           Changed;
+    Prefix                        Cursor;
+    bool                          Started;
+    bool                          Forgotten;
+    // Gone, but its request on hosts.deny is still to be completed
+    bool                          Closing;
+    // Done sending requests, but still waiting for the answers
+    bool                          Ended;
+    // Events it is currently watched for
+    unsigned int                  Interest;
+
+    explicit ControlClient(int Accepted)
+      : Socket(Accepted), Streaming(false), Job(-1), Banning(false),
+        Applying(false), Changed(0), Started(false), Forgotten(false),
+        Closing(false), Ended(false), Interest(0) {}
+};
+
+static int ControlSocket = -1;
+static std::list<ControlClient> ControlClients;
+
+// One line per host:
+// <address> <attempts> <attempts left before ban> <first seen> <expire> <tracked|banned>
+static std::string FormatHost(const HostIP & Host) {
+    std::ostringstream Line;
+
+    Line << Host.Address << " " << Host.Attempts << " "
+         << (Host.Attempts >= MaxAttempts ? 0 : MaxAttempts - Host.Attempts) << " "
+         << Host.FirstSeen << " " << Host.Expire << " "
+         << (Host.Written ? "banned" : "tracked") << "\n";
+
+    return Line.str();
+}
+
+// The hosts within a network are contiguous in the table
+static HostMap::iterator FirstInPrefix(HostTable & Hosts, const Prefix & Network) {
+    return Hosts.Tracked.lower_bound(Network);
+}
+
+static void StartStream(ControlClient & Client, HostTable & Hosts) {
+    Snapshot Taken;
+
+    memset(&Taken.Cursor, 0, sizeof(Taken.Cursor));
+    Taken.Generation = Hosts.Generation++;
+    Taken.Started = false;
+    Hosts.Snapshots.push_back(Taken);
+
+    Client.Dump = --Hosts.Snapshots.end();
+    Client.Streaming = true;
+}
+
+static void StopStream(ControlClient & Client, HostTable & Hosts) {
+    if (Client.Streaming) {
+        Hosts.Snapshots.erase(Client.Dump);
+        Client.Streaming = false;
+    }
+}
+
+// Stream the snapshot slice by slice, so that a large table never holds
+// the main loop for long. It isn't copied: it's the live table, but for
+// the hosts added since, and with the hosts changed since as they were
+static void StreamSnapshot(ControlClient & Client, HostTable & Hosts) {
+    size_t Slice = 0;
+
+    if (!Client.Streaming) {
+        return;
+    }
+
+    Snapshot & Dump = *Client.Dump;
+    HostMap::const_iterator Live = (Dump.Started ? Hosts.Tracked.upper_bound(Dump.Cursor) :
+                                                   Hosts.Tracked.begin());
+
+    while (Slice < StreamSlice && Client.Output.length() < MaxPending) {
+        HostMap::iterator Saved = Dump.Saved.begin();
+        bool HasLive = (Live != Hosts.Tracked.end());
+        bool HasSaved = (Saved != Dump.Saved.end());
+
+        if (!HasLive && !HasSaved) {
+            Client.Output += "OK\n";
+            StopStream(Client, Hosts);
+            return;
+        }
+
+        if (HasSaved && (!HasLive || !AddressOrder()((*Live).first, (*Saved).first))) {
+            // It changed since, or it's gone
+            Client.Output += FormatHost((*Saved).second);
+            Dump.Cursor = (*Saved).first;
+            if (HasLive && !AddressOrder()((*Saved).first, (*Live).first)) {
+                ++Live;
+            }
+            Dump.Saved.erase(Saved);
+        } else {
+            if ((*Live).second.Born <= Dump.Generation) {
+                Client.Output += FormatHost((*Live).second);
+            }
+            Dump.Cursor = (*Live).first;
+            ++Live;
+        }
+
+        Dump.Started = true;
+        ++Slice;
+    }
+}
+
+// Changes to hosts.deny are made by a child, so that the main loop
+// never waits for its lock nor for the disk
+// Returns the descriptor the result will come from, -1 on failure
+static int StartDenyJob(bool Banning, const Prefix & Network) {
+    int Result[2];
+
+    if (pipe2(Result, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    pid_t Child = fork();
+    if (Child == -1) {
+        close(Result[0]);
+        close(Result[1]);
+        return -1;
+    }
+
+    if (Child > 0) {
+        close(Result[1]);
+        return Result[0];
+    }
+
+    int Changed = (Banning ? AppendToDeny(DenyEntry(Network), Network) : RemoveFromDeny(Network));
+    unused_return(write(Result[1], &Changed, sizeof(Changed)) != sizeof(Changed));
+    exit(EXIT_SUCCESS);
+}
+
+// Collects the outcome of the child changing hosts.deny
+static void FinishDenyJob(ControlClient & Client) {
+    int Changed = -1;
+
+    if (read(Client.Job, &Changed, sizeof(Changed)) != sizeof(Changed)) {
+        Changed = -1;
+    }
+
+    close(Client.Job);
+    Client.Job = -1;
+
+    if (Changed < 0) {
+        Client.Output += "ERR cannot write deny file\n";
+        return;
+    }
+
+    Client.Applying = true;
+    Client.Changed = Changed;
+    Client.Started = false;
+    Client.Forgotten = false;
+}
+
+// The hosts follow what was done to hosts.deny. Like DUMP, it goes a
+// slice at a time, so that a large network never holds the main loop
+static void ApplyDenyJob(ControlClient & Client, HostTable & Hosts) {
+    size_t Slice = 0;
+
+    if (!Client.Applying) {
+        return;
+    }
+
+    HostMap::iterator it = (Client.Started ? Hosts.Tracked.upper_bound(Client.Cursor) :
+                                             FirstInPrefix(Hosts, Client.Network));
+    for (; it != Hosts.Tracked.end() && InPrefix(Client.Network, (*it).first); ++Slice) {
+        if (Slice == StreamSlice) {
+            return;
+        }
+
+        Client.Cursor = (*it).first;
+        Client.Started = true;
+
+        if (Client.Banning) {
+            // Don't write them once again
+            ChangingHost(Hosts, (*it).second);
+            (*it).second.Written = true;
+            ChangedHost(Hosts, (*it).second);
+            ++it;
+        } else {
+            // Forget about them, they start over
+            RemoveHost(Hosts, it++);
+            Client.Forgotten = true;
+        }
+    }
+
+    Client.Applying = false;
+
+    if (Client.Banning) {
+        if (Client.Changed == 0) {
+            Client.Output += "ERR already banned\n";
+            return;
+        }
+
+        syslog(LOG_INFO, "Manually banned %s", Client.Argument.c_str());
+        Client.Output += "OK\n";
+    } else {
+        if (Client.Changed == 0 && !Client.Forgotten) {
+            Client.Output += "ERR not banned\n";
+            return;
+        }
+
+        std::ostringstream Answer;
+        Answer << "OK " << Client.Changed << "\n";
+
+        syslog(LOG_INFO, "Manually unbanned %s (%d entries)", Client.Argument.c_str(), Client.Changed);
+        Client.Output += Answer.str();
+    }
+}
+
+static void HandleRequest(ControlClient & Client, const std::string & Request,
+                          HostTable & Hosts) {
+    std::istringstream Parser(Request);
+    std::string Command;
+    std::string Argument;
+    std::string Extra;
+    Prefix Network;
+
+    Parser >> Command >> Argument >> Extra;
+    std::transform(Command.begin(), Command.end(), Command.begin(), ::toupper);
+
+    if (Command.empty()) {
+        return;
+    }
+
+    if (!Extra.empty()) {
+        Client.Output += "ERR too many arguments\n";
+        return;
+    }
+
+    if (Command == "RULES") {
+        if (!Argument.empty()) {
+            Client.Output += "ERR too many arguments\n";
+            return;
+        }
+
+        // <name> <hits>, in matching order
+        for (std::vector<Rule>::const_iterator it = Failures.Rules.begin();
+             it != Failures.Rules.end(); ++it) {
+            std::ostringstream Line;
+            Line << (*it).Name << " " << (*it).Hits << "\n";
+            Client.Output += Line.str();
+        }
+        Client.Output += "OK\n";
+    } else if (Command == "DUMP") {
+        StartStream(Client, Hosts);
+    } else if (Command == "TOP") {
+        unsigned long int Count = DefaultTop;
+        if (!Argument.empty()) {
+            if (Argument.find_first_not_of("0123456789") != std::string::npos) {
+                Client.Output += "ERR invalid count\n";
+                return;
+            }
+            Count = strtoul(Argument.c_str(), 0, 10);
+        }
+
+        // Hosts are ranked as they change, the top is only read
+        // At most a slice of it, DUMP is there for the whole table
+        Count = std::min(Count, (unsigned long int)StreamSlice);
+        for (std::set<const HostIP *, MoreAttempts>::const_iterator it = Hosts.Ranks.begin();
+             it != Hosts.Ranks.end() && Count > 0; ++it, --Count) {
+            Client.Output += FormatHost(**it);
+        }
+        Client.Output += "OK\n";
+    } else if (Command == "LOOKUP" || Command == "BAN" || Command == "UNBAN") {
+        if (Argument.empty()) {
+            Client.Output += "ERR missing address\n";
+            return;
+        }
+
+        if (!ParsePrefix(Argument, Network) ||
+            (Command == "LOOKUP" && Network.Length != (Network.Family == AF_INET ? IPv4::Bits : IPv6::Bits))) {
+            Client.Output += "ERR invalid address\n";
+            return;
+        }
+
+        if (Command == "LOOKUP") {
+            HostMap::const_iterator it = Hosts.Tracked.find(Network);
+            if (it == Hosts.Tracked.end()) {
+                Client.Output += "ERR not tracked\n";
+                return;
+            }
+
+            Client.Output += FormatHost((*it).second) + "OK\n";
+        } else {
+            Client.Banning = (Command == "BAN");
+            Client.Job = StartDenyJob(Client.Banning, Network);
+            if (Client.Job < 0 || !Watch(EPOLL_CTL_ADD, Client.Job, EPOLLIN)) {
+                if (Client.Job >= 0) {
+                    close(Client.Job);
+                    Client.Job = -1;
+                }
+
+                Client.Output += "ERR cannot write deny file\n";
+                return;
+            }
+
+            Client.Network = Network;
+            Client.Argument = Argument;
+        }
+    } else {
+        Client.Output += "ERR unknown command\n";
+    }
+}
+
+static bool OpenControl() {
+    struct sockaddr_un Address;
+
+    if (strlen(ControlFile) >= sizeof(Address.sun_path)) {
+        return false;
+    }
+
+    ControlSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ControlSocket < 0) {
+        return false;
+    }
+
+    memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    strcpy(Address.sun_path, ControlFile);
+
+    // Remove any left over from a previous run
+    unlink(ControlFile);
+
+    // Only root is to control us, the socket must not be
+    // reachable by others, not even until its mode is set
+    mode_t Mask = umask(S_IRWXG | S_IRWXO);
+    int Bound = bind(ControlSocket, reinterpret_cast<struct sockaddr *>(&Address), sizeof(Address));
+    umask(Mask);
+
+    if (Bound < 0 ||
+        chmod(ControlFile, S_IRUSR | S_IWUSR) < 0 ||
+        listen(ControlSocket, (int)MaxClients) < 0 ||
+        !Watch(EPOLL_CTL_ADD, ControlSocket, EPOLLIN)) {
+        close(ControlSocket);
+        unlink(ControlFile);
+        ControlSocket = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static void CloseControl() {
+    for (std::list<ControlClient>::iterator it = ControlClients.begin();
+         it != ControlClients.end(); ++it) {
+        close((*it).Socket);
+        if ((*it).Job != -1) {
+            close((*it).Job);
+        }
+    }
+    ControlClients.clear();
+
+    if (ControlSocket != -1) {
+        close(ControlSocket);
+        unlink(ControlFile);
+        ControlSocket = -1;
+    }
+}
+
+// Whether the client can make progress without waiting for I/O
+static bool CanProgress(const ControlClient & Client) {
+    return ((Client.Streaming && Client.Output.length() < MaxPending) || Client.Applying);
+}
+
+// Whether some client can make progress without waiting for I/O
+static bool ControlPending() {
+    for (std::list<ControlClient>::const_iterator it = ControlClients.begin();
+         it != ControlClients.end(); ++it) {
+        if (CanProgress(*it)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns false if the client is to be dropped
+static bool ServeClient(ControlClient & Client, unsigned int Events, HostTable & Hosts) {
+    if (Events & EPOLLERR) {
+        return false;
+    }
+
+    if (Events & (EPOLLIN | EPOLLHUP)) {
+        char Buffer[MaxRequest];
+        ssize_t Length = recv(Client.Socket, Buffer, sizeof(Buffer), 0);
+        if (Length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+
+        if (Length > 0) {
+            Client.Input.append(Buffer, (size_t)Length);
+        } else if (Length == 0) {
+            // Hung up both ways, nothing can be sent anymore
+            if (Client.Ended) {
+                return false;
+            }
+
+            // Only its sending side is closed (shutdown), answer what
+            // it asked for. The last request may lack its newline
+            Client.Ended = true;
+            if (!Client.Input.empty() && Client.Input[Client.Input.length() - 1] != '\n') {
+                Client.Input += '\n';
+            }
+        }
+    }
+
+    // Requests are handled one after another, in order
+    // A request being streamed or changing hosts.deny holds the following ones
+    for (;;) {
+        StreamSnapshot(Client, Hosts);
+        ApplyDenyJob(Client, Hosts);
+        if (Client.Streaming || Client.Job != -1 || Client.Applying) {
+            break;
+        }
+
+        size_t End = Client.Input.find('\n');
+        if (End == std::string::npos) {
+            // Request too long, give up
+            if (Client.Input.length() >= MaxRequest) {
+                return false;
+            }
+            break;
+        }
+
+        std::string Request = Client.Input.substr(0, End);
+        Client.Input.erase(0, End + 1);
+        HandleRequest(Client, Request, Hosts);
+    }
+
+    if (!Client.Output.empty()) {
+        ssize_t Length = send(Client.Socket, Client.Output.c_str(), Client.Output.length(),
+                              MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (Length < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+
+        if (Length > 0) {
+            Client.Output.erase(0, (size_t)Length);
+        }
+    }
+
+    if (Client.Ended && !Client.Streaming && Client.Job == -1 && !Client.Applying &&
+        Client.Output.empty()) {
+        return false;
+    }
+
+    // Only wait for what can be handled
+    unsigned int Interest = 0;
+    if (!Client.Ended && Client.Input.length() < MaxRequest) {
+        Interest |= EPOLLIN;
+    }
+    if (!Client.Output.empty()) {
+        Interest |= EPOLLOUT;
+    }
+
+    if (Interest != Client.Interest) {
+        if (!Watch(EPOLL_CTL_MOD, Client.Socket, Interest)) {
+            return false;
+        }
+        Client.Interest = Interest;
+    }
+
+    return true;
+}
+
+static void AcceptClients() {
+    while (ControlClients.size() < MaxClients) {
+        int Client = accept4(ControlSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (Client < 0) {
+            break;
+        }
+
+        // Whatever the socket mode, only serve root
+        struct ucred Peer;
+        socklen_t PeerLength = sizeof(Peer);
+        if (getsockopt(Client, SOL_SOCKET, SO_PEERCRED, &Peer, &PeerLength) < 0 ||
+            (Peer.uid != 0 && Peer.uid != geteuid())) {
+            close(Client);
+            continue;
+        }
+
+        if (!Watch(EPOLL_CTL_ADD, Client, EPOLLIN)) {
+            close(Client);
+            continue;
+        }
+
+        ControlClients.push_back(ControlClient(Client));
+        ControlClients.back().Interest = EPOLLIN;
+    }
+}
+
+// Serve the client owning the descriptor, if any
+// Without descriptor, serve the clients that can progress on their own
+static bool ServeControl(int FD, unsigned int Events, HostTable & Hosts) {
+    if (ControlSocket == -1) {
+        return false;
+    }
+
+    if (FD == ControlSocket) {
+        AcceptClients();
+        return true;
+    }
+
+    std::list<ControlClient>::iterator it = ControlClients.begin();
+    while (it != ControlClients.end()) {
+        ControlClient & Client = *it;
+        bool Keep;
+
+        if ((FD != -1 && Client.Socket != FD && Client.Job != FD) ||
+            (FD == -1 && !CanProgress(Client))) {
+            ++it;
+            continue;
+        }
+
+        if (FD != -1 && FD == Client.Job) {
+            FinishDenyJob(Client);
+            Keep = (!Client.Closing && ServeClient(Client, 0, Hosts));
+        } else if (Client.Closing) {
+            ApplyDenyJob(Client, Hosts);
+            Keep = false;
+        } else {
+            Keep = ServeClient(Client, Events, Hosts);
+        }
+
+        // Even if it's gone, see its change to hosts.deny through
+        if (!Keep && (Client.Job != -1 || Client.Applying)) {
+            if (!Client.Closing) {
+                Watch(EPOLL_CTL_DEL, Client.Socket, 0);
+                Client.Closing = true;
+            }
+            Keep = true;
+        }
+
+        if (!Keep) {
+            StopStream(Client, Hosts);
+            close(Client.Socket);
+            it = ControlClients.erase(it);
+        } else {
+            ++it;
+        }
+
+        if (FD != -1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void ArmTimer(int Timer, time_t Seconds, long int Nanoseconds, int Flags) {
+    struct itimerspec Spec;
+
+    // All zeroes disarms the timer
+    memset(&Spec, 0, sizeof(Spec));
+    Spec.it_value.tv_sec = Seconds;
+    Spec.it_value.tv_nsec = Nanoseconds;
+
+    soft_assert(timerfd_settime(Timer, Flags, &Spec, NULL) == 0);
+}
+
+static void DrainTimer(int Timer) {
+    char Expirations[8];
+
+    unused_return(read(Timer, Expirations, sizeof(Expirations)));
+}
+
+// The log being followed, and how
+struct LogWatch {
+    int          File;
+    // The rotated log, until nothing more can be written to it
+    int          Old;
+    // Periodic work: waiting for the log to come back, or polling it
+    int          Tick;
+#ifndef WITHOUT_INOTIFY
+    int          iNotify;
+    int          iAuth;
+    int          iOld;
+    unsigned int Attempts;
+#else
+    long int     Interval;
+#endif
+};
+
+// The syslog daemon keeps writing to the rotated log until it's told
+// to reopen it. Once it wrote to the new log, the old one is complete
+static void CloseOldLog(LogWatch & Log, HostTable & Hosts) {
+    if (Log.Old == -1) {
+        return;
+    }
+
+    ReadLine(Log.Old, Hosts);
+
+#ifndef WITHOUT_INOTIFY
+    inotify_rm_watch(Log.iNotify, Log.iOld);
+    Log.iOld = -1;
+#endif
+
+    soft_assert(close(Log.Old) == 0);
+    Log.Old = -1;
+}
+
+// Returns whether anything was read
+static bool ReadNewLog(LogWatch & Log, HostTable & Hosts) {
+    struct stat Opened;
+
+    if (Log.Old != -1 && fstat(Log.File, &Opened) == 0 && Opened.st_size > 0) {
+        CloseOldLog(Log, Hosts);
+    }
+
+    return ReadLine(Log.File, Hosts);
+}
+
+#ifndef WITHOUT_INOTIFY
+static bool WatchLog(LogWatch & Log) {
+    Log.iAuth = inotify_add_watch(Log.iNotify, AuthLogFile,
+                                  IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    return (Log.iAuth >= 0);
+}
+
+// Returns false if we have to give up
+static bool ReopenLog(LogWatch & Log, HostTable & Hosts) {
+    Log.File = open(AuthLogFile, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (Log.File < 0) {
+        // We will wait a bit to allow rotation
+        if (++Log.Attempts >= MaxWaitRotate) {
+            syslog(LOG_CRIT, "Failed to reopen auth.log. Quitting.");
+            return false;
+        }
+
+        ArmTimer(Log.Tick, 1, 0, 0);
+        return true;
+    }
+
+    // Reinit watching
+    if (!WatchLog(Log)) {
+        syslog(LOG_CRIT, "Failed to rewatch auth.log. Quitting.");
+        return false;
+    }
+
+    // The log is new, whatever it holds was written after rotation
+    // so read it from the start
+    ReadNewLog(Log, Hosts);
+
+    return true;
+}
+
+static bool OnLogRotated(LogWatch & Log, HostTable & Hosts) {
+    // Two rotations in a row, the first log is done
+    CloseOldLog(Log, Hosts);
+
+    // Keep reading the file where it went, it's still being written
+    ReadLine(Log.File, Hosts);
+    Log.Old = Log.File;
+    Log.iOld = Log.iAuth;
+
+    // And restart on the new one
+    Log.File = -1;
+    Log.iAuth = -1;
+    Log.Attempts = 0;
 
-#ifndef WITHOUT_INOTIFY
-    int iNotify = inotify_init1(IN_NONBLOCK);
-    if (iNotify < 0) {
-        close(AuthLog);
-        exit(EXIT_FAILURE);
+    return ReopenLog(Log, Hosts);
+}
+
+// Returns false if we have to give up
+static bool OnLogEvents(LogWatch & Log, HostTable & Hosts) {
+    // Make sure our buffer is big enough for data & name, and aligned
+    long int Buffer[(sizeof(struct inotify_event) + NAME_MAX + 1) / sizeof(long int) + 1];
+    bool Rotated = false;
+    bool Modified = false;
+    bool OldModified = false;
+    ssize_t Length;
+
+    while ((Length = read(Log.iNotify, Buffer, sizeof(Buffer))) > 0) {
+        const char * Current = reinterpret_cast<const char *>(Buffer);
+        const char * End = Current + Length;
+
+        while (Current + sizeof(struct inotify_event) <= End) {
+            struct inotify_event Event;
+            struct stat Opened;
+
+            memcpy(&Event, Current, sizeof(Event));
+            if (Event.wd == Log.iAuth && Log.iAuth != -1) {
+                if (Event.mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    Rotated = true;
+                } else if (Event.mask & IN_MODIFY) {
+                    Modified = true;
+                } else if ((Event.mask & IN_ATTRIB) &&
+                           fstat(Log.File, &Opened) == 0 && Opened.st_nlink == 0) {
+                    // Deleted, but kept alive by us
+                    Rotated = true;
+                }
+            } else if (Event.wd == Log.iOld && Log.iOld != -1 && (Event.mask & IN_MODIFY)) {
+                OldModified = true;
+            }
+
+            Current += sizeof(Event) + Event.len;
+        }
     }
 
-    int iAuth = inotify_add_watch(iNotify, AuthLogFile,
-                                  IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
-    if (iAuth < 0) {
-        close(iNotify);
-        close(AuthLog);
-        exit(EXIT_FAILURE);
+    if (OldModified && Log.Old != -1) {
+        ReadLine(Log.Old, Hosts);
+    }
+
+    if (Modified && Log.File != -1) {
+        ReadNewLog(Log, Hosts);
+    }
+
+    if (Rotated) {
+        return OnLogRotated(Log, Hosts);
+    }
+
+    return true;
+}
+
+static bool OnLogTick(LogWatch & Log, HostTable & Hosts) {
+    if (Log.File != -1) {
+        return true;
+    }
+
+    return ReopenLog(Log, Hosts);
+}
+#else
+// Without inotify, poll the log: often when it's active,
+// less and less when it's idle
+static bool OnLogTick(LogWatch & Log, HostTable & Hosts) {
+    struct stat Current;
+    struct stat Opened;
+    bool Active = false;
+
+    if (Log.Old != -1) {
+        Active = ReadLine(Log.Old, Hosts);
+    }
+
+    if (Log.File != -1) {
+        Active = (ReadNewLog(Log, Hosts) || Active);
+    }
+
+    // Check whether the log got rotated or truncated
+    if (stat(AuthLogFile, &Current) == 0 &&
+        (Log.File == -1 || fstat(Log.File, &Opened) < 0 ||
+         Current.st_dev != Opened.st_dev || Current.st_ino != Opened.st_ino ||
+         Current.st_size < lseek(Log.File, 0, SEEK_CUR))) {
+        if (Log.File != -1) {
+            if (Current.st_dev == Opened.st_dev && Current.st_ino == Opened.st_ino) {
+                // Truncated, nothing more will come to what we read
+                close(Log.File);
+            } else {
+                // Moved, keep reading it while it's still being written
+                CloseOldLog(Log, Hosts);
+                Log.Old = Log.File;
+            }
+        }
+
+        // Everything in the new log was written since we last looked
+        Log.File = open(AuthLogFile, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (Log.File != -1) {
+            Active = (ReadNewLog(Log, Hosts) || Active);
+        }
     }
+
+    // Poll less while the log is idle, but never see a failure
+    // later than the former one second polling did
+    Log.Interval = (Active ? MinPollInterval : std::min(Log.Interval * 2, MaxPollInterval));
+    ArmTimer(Log.Tick, Log.Interval / 1000, (Log.Interval % 1000) * 1000000, 0);
+
+    return true;
+}
 #endif
 
-    for (;;) {
-#ifndef WITHOUT_INOTIFY
-        struct pollfd FDs[] = {
-            {iNotify, POLLIN, 0},
-        };
+struct BanRecord {
+    std::string       Address;
+    long unsigned int Bans;
+    long unsigned int Attempts;
+    time_t            FirstBan;
+    time_t            TimeToBan;
+};
+
+static std::map<std::string, BanRecord> ReplayBans;
+
+static std::string FormatTime(time_t Date) {
+    struct tm Broken;
+    char Buffer[sizeof("YYYY-MM-DD HH:MM:SS")];
+
+    if (gmtime_r(&Date, &Broken) == 0 ||
+        strftime(Buffer, sizeof(Buffer), "%Y-%m-%d %H:%M:%S", &Broken) == 0) {
+        return "?";
+    }
+
+    return Buffer;
+}
 
-        int Timeout = -1;
-        // Set the poll timeout to the first
-        // expired host to purge
-        if (!Hosts.empty()) {
-            Timeout = (int)Hosts.back().Expire - (int)time(0) * 1000;
+// Instead of denying, put the ban on the timeline
+static void RecordBan(const HostIP & Host) {
+    time_t TimeToBan = Now() - Host.FirstSeen;
+
+    std::cout << FormatTime(Now()) << " BAN " << Host.Address << " attempts=" << Host.Attempts
+              << " first=" << FormatTime(Host.FirstSeen) << " ttb=" << TimeToBan << "\n";
+
+    std::map<std::string, BanRecord>::iterator it = ReplayBans.find(Host.Address);
+    if (it == ReplayBans.end()) {
+        BanRecord New = {Host.Address, 0, 0, Now(), TimeToBan};
+        it = ReplayBans.insert(std::make_pair(Host.Address, New)).first;
+    }
+
+    ++(*it).second.Bans;
+    (*it).second.Attempts += Host.Attempts;
+}
+
+// Timestamps are either the traditional syslog ones, "Mar  8 13:40:21",
+// which lack the year, or RFC 3339 ones, "2015-03-08T13:40:21.123+01:00"
+// Both are taken as UTC, unless an offset is given
+// Traditional timestamps have no year, NeedYear is set when
+// one is met while Year is still unknown (0)
+static bool ParseTimestamp(const std::string & Line, int & Year, int & LastMonth, time_t & Date,
+                           bool & NeedYear) {
+    static char const * const Months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+    };
+    struct tm Broken;
+    int Consumed = 0;
+    char Month[4];
+
+    memset(&Broken, 0, sizeof(Broken));
+
+    if (sscanf(Line.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &Broken.tm_year, &Broken.tm_mon,
+               &Broken.tm_mday, &Broken.tm_hour, &Broken.tm_min, &Broken.tm_sec, &Consumed) == 6) {
+        size_t Offset = Line.find_first_not_of("0123456789", (size_t)Consumed + (Line[(size_t)Consumed] == '.' ? 1 : 0));
+        int Hours = 0;
+        int Minutes = 0;
+
+        Broken.tm_year -= 1900;
+        Broken.tm_mon -= 1;
+        Date = timegm(&Broken);
+
+        // Bring it back to UTC
+        if (Offset != std::string::npos && (Line[Offset] == '+' || Line[Offset] == '-') &&
+            sscanf(Line.c_str() + Offset + 1, "%2d:%2d", &Hours, &Minutes) == 2) {
+            time_t Shift = (time_t)(Hours * 3600 + Minutes * 60);
+            Date = (Line[Offset] == '+' ? Date - Shift : Date + Shift);
         }
 
-        int Event = poll(FDs, 1, Timeout);
-        if (Event < 0) {
-            break;
-        } else if (Event > 0) {
-            // Make sure our iEvent is big enough for data & name
-            struct {
-                struct inotify_event Event;
-                char Buffer[NAME_MAX + 1];
-            } iEvent;
-
-            // Read the pending event
-            // It will concern iAuth
-            iEvent.Event.len = 0;
-            soft_assert(read(iNotify, &iEvent, offsetof(struct inotify_event, name)) ==
-                        offsetof(struct inotify_event, name));
-
-            // If we have a name, read it
-            if (iEvent.Event.len > 0) {
-                soft_assert(read(iNotify, iEvent.Event.name, iEvent.Event.len) == iEvent.Event.len);
-            }
-
-            // Check the event
-            if (iEvent.Event.mask & IN_MOVE_SELF ||
-                iEvent.Event.mask & IN_DELETE_SELF) {
-                // We got moved/deleted (likely log rotate)
-                soft_assert((iEvent.Event.mask & IN_MODIFY) != IN_MODIFY);
-
-                // Remove the file from watch list
-                inotify_rm_watch(iNotify, iAuth);
-
-                // Close file and restart
-                soft_assert(close(AuthLog) == 0);
-
-                // We will wait a bit to allow rotation
-                for (unsigned int Attempts = 0; Attempts < MaxWaitRotate; ++Attempts) {
-                    AuthLog = open(AuthLogFile, O_RDONLY | O_NONBLOCK);
-                    if (AuthLog != -1) {
-                        break;
-                    }
+        Year = Broken.tm_year + 1900;
+        LastMonth = Broken.tm_mon;
+        return true;
+    }
 
-                    sleep(1);
-                }
+    if (sscanf(Line.c_str(), "%3s %2d %2d:%2d:%2d", Month, &Broken.tm_mday,
+               &Broken.tm_hour, &Broken.tm_min, &Broken.tm_sec) == 5) {
+        for (int Current = 0; Current < 12; ++Current) {
+            if (strcmp(Month, Months[Current]) != 0) {
+                continue;
+            }
 
-                // Check the wait loop was a success
-                if (AuthLog < 0) {
-                    AuthLog = 0;
-                    syslog(LOG_CRIT, "Failed to reopen auth.log. Quitting.");
-                    break;
-                }
+            if (Year == 0) {
+                NeedYear = true;
+                return false;
+            }
+
+            // Going back in the year means a new one started
+            if (Current < LastMonth) {
+                ++Year;
+            }
+            LastMonth = Current;
 
-                // Only take care of new entries
-                lseek(AuthLog, 0, SEEK_END);
+            Broken.tm_mon = Current;
+            Broken.tm_year = Year - 1900;
+            Date = timegm(&Broken);
+            return true;
+        }
+    }
 
-                // Reinit watching
-                iAuth = inotify_add_watch(iNotify, AuthLogFile,
-                                          IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
-                if (iAuth < 0) {
-                    syslog(LOG_CRIT, "Failed to rewatch auth.log. Quitting.");
-                    break;
-                }
+    return false;
+}
+
+// Feeds a log through the whole pipeline as fast as possible,
+// with time being the one of the log lines
+static int Replay(const char * Capture, int Year) {
+    static HostTable Hosts;
+    std::ifstream File(Capture, std::ios::in | std::ios::binary);
+    LineSplitter Splitter;
+    char Buffer[4096];
+    std::streamsize Next = 0;
+    std::streamsize Available = 0;
+    int LastMonth = 0;
+    long unsigned int Lines = 0;
+
+    if (!File) {
+        std::cerr << "Failed to open " << Capture << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Now = VirtualClock;
+    Ban = RecordBan;
+
+    std::cout << "# Replay of " << Capture << "\n";
+    // Lines are split as the daemon splits them when reading the log
+    for (;;) {
+        bool NeedYear = false;
+        bool Complete;
+        time_t Date;
+
+        if (Next == Available) {
+            File.read(Buffer, sizeof(Buffer));
+            Available = File.gcount();
+            Next = 0;
+        }
+
+        if (Available == 0) {
+            if (!EndLine(Splitter)) {
+                break;
+            }
+        } else {
+            Complete = SplitLine(Splitter, Buffer[Next]);
+            ++Next;
 
-                // Move back to watching
+            if (!Complete) {
                 continue;
             }
         }
 
-        // Whatever happens, fall through
-        // We have at least hosts to purge
-#endif
-        ReadLine(AuthLog, Hosts);
+        std::string Line(Splitter.Line, Splitter.Read);
+
+        // Lines without timestamp happen at the same time as the previous one
+        if (ParseTimestamp(Line, Year, LastMonth, Date, NeedYear)) {
+            VirtualTime = Date;
+        } else if (NeedYear) {
+            // Don't guess it, the outcome would depend on the day of the replay
+            std::cerr << "No year in the timestamp at line " << (Lines + 1)
+                      << " of " << Capture << ", give it with -y" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        PurgeHosts(Hosts);
+        ProcessLine(Line.c_str(), Line.length(), Hosts);
+        ++Lines;
+    }
+
+    // Time to ban of each attacker, for its first ban
+    std::cout << "# " << Lines << " lines, " << ReplayBans.size() << " attackers banned\n";
+    for (std::map<std::string, BanRecord>::const_iterator it = ReplayBans.begin();
+         it != ReplayBans.end(); ++it) {
+        std::cout << (*it).first << " bans=" << (*it).second.Bans << " attempts=" << (*it).second.Attempts
+                  << " first=" << FormatTime((*it).second.FirstBan) << " ttb=" << (*it).second.TimeToBan << "\n";
+    }
+
+    std::cout << "# Rules\n";
+    for (std::vector<Rule>::const_iterator it = Failures.Rules.begin();
+         it != Failures.Rules.end(); ++it) {
+        std::cout << (*it).Name << " " << (*it).Hits << "\n";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void Usage(const char * Program) {
+    std::cerr << "Usage: " << Program << " [-4] [-6] [-f rules] [-r log [-y year]]" << std::endl;
+    std::cerr << "  -4  Watch for IPv4 failed connections" << std::endl;
+    std::cerr << "  -6  Watch for IPv6 failed connections" << std::endl;
+    std::cerr << "Both can be combined. Default is " << DefaultFamilies << "." << std::endl;
+    std::cerr << "  -f  Read failure rules from this file instead of " << RULES_FILE << std::endl;
+    std::cerr << "  -r  Replay this log and print the bans instead of running" << std::endl;
+    std::cerr << "  -y  Year of the replayed log, required when not in its timestamps" << std::endl;
+}
+
+int main(int argc, char ** argv) {
+    static HostTable Hosts;
+    static char RulesPath[PATH_MAX];
+    struct sigaction SigHandling;
+    bool WithIPv4 = false;
+    bool WithIPv6 = false;
+    const char * Capture = 0;
+    int Year = 0;
+    int Option;
+
+    // Get the families to watch for
+    while ((Option = getopt(argc, argv, "46f:r:y:h")) != -1) {
+        switch (Option) {
+            case '4':
+                WithIPv4 = true;
+                break;
+
+            case '6':
+                WithIPv6 = true;
+                break;
+
+            case 'f':
+                // The daemon runs from /, make it still find the file on reload
+                RulesFile = (realpath(optarg, RulesPath) != NULL ? RulesPath : optarg);
+                break;
+
+            case 'r':
+                Capture = optarg;
+                break;
 
-        // Purge queue of expired hosts
-        while (!Hosts.empty()) {
-            if (Hosts.back().Expire > time(0)) {
+            case 'y':
+                Year = atoi(optarg);
                 break;
+
+            case 'h':
+                Usage(argv[0]);
+                exit(EXIT_SUCCESS);
+
+            default:
+                Usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc || (Year != 0 && Capture == 0)) {
+        Usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Nothing specified, fall back to build defaults
+    if (!WithIPv4 && !WithIPv6) {
+#ifdef WITH_IPV4
+        WithIPv4 = true;
+#endif
+        WithIPv6 = true;
+    }
+
+    // And select the matching parser
+    if (WithIPv4 && WithIPv6) {
+        MatchLine = MatchRules<Either<IPv6, IPv4> >;
+    } else if (WithIPv4) {
+        MatchLine = MatchRules<Only<IPv4> >;
+    } else {
+        MatchLine = MatchRules<Only<IPv6> >;
+    }
+
+    // Replay runs in foreground, and reports on the terminal
+    if (Capture != 0) {
+        openlog("ForbidHosts", LOG_PERROR, LOG_USER);
+        LoadRules(Failures);
+        exit(Replay(Capture, Year));
+    }
+
+    // Shutdown and reload signals are received by the main loop
+    // Block them, so that they are only delivered there
+    sigemptyset(&LoopSignals);
+    sigaddset(&LoopSignals, SIGTERM);
+    sigaddset(&LoopSignals, SIGINT);
+    sigaddset(&LoopSignals, SIGQUIT);
+    sigaddset(&LoopSignals, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &LoopSignals, NULL) < 0) {
+        std::cerr << "Failed to block signals" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&SigHandling, 0, sizeof(struct sigaction));
+    SigHandling.sa_sigaction = ExceptionHandler;
+    SigHandling.sa_flags = SA_SIGINFO | SA_RESETHAND;
+
+    // Install exceptions handler
+    if (sigaction(SIGABRT, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGBUS, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGFPE, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGILL, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGSEGV, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGSYS, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGXCPU, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (sigaction(SIGXFSZ, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Prevent zombies
+    SigHandling.sa_handler = NULL;
+    SigHandling.sa_flags = SA_NOCLDWAIT;
+    if (sigaction(SIGCHLD, &SigHandling, NULL) < 0) {
+        std::cerr << "Failed to install signal handler" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    syslog(LOG_INFO, "Daemon starting up");
+    setlogmask(LOG_MASK(LOG_INFO) | LOG_MASK(LOG_CRIT) | LOG_MASK(LOG_NOTICE));
+    openlog("ForbidHosts", LOG_CONS, LOG_USER);
+
+    // Compile the failure patterns
+    LoadRules(Failures);
+
+    // Start deamon
+    pid_t Deamon = fork();
+    if (Deamon < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (Deamon > 0) {
+        exit(EXIT_SUCCESS);
+    }
+
+    // Quit session
+    umask(0);
+    if (setsid() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Go back to root
+    if ((chdir("/")) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Get rid of useless descriptors
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+
+#ifndef WITHOUT_EMAIL
+    // Get our hostname
+    {
+        char HostName[HOST_NAME_MAX + 1];
+        if (gethostname(HostName, sizeof(HostName)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+
+        sprintf(MailCommand, MailCommandTpl, HostName);
+        sprintf(CrashMail, CrashMailTpl, HostName);
+    }
+#endif
+
+    LogWatch Log;
+    Log.Old = -1;
+    Log.File = open(AuthLogFile, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (Log.File < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Only take care of new entries
+    lseek(Log.File, 0, SEEK_END);
+
+    EventLoop = epoll_create1(EPOLL_CLOEXEC);
+    int Signals = signalfd(-1, &LoopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+    int Expiry = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    Log.Tick = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (EventLoop < 0 || Signals < 0 || Expiry < 0 || Log.Tick < 0 ||
+        !Watch(EPOLL_CTL_ADD, Signals, EPOLLIN) ||
+        !Watch(EPOLL_CTL_ADD, Expiry, EPOLLIN) ||
+        !Watch(EPOLL_CTL_ADD, Log.Tick, EPOLLIN)) {
+        exit(EXIT_FAILURE);
+    }
+
+#ifndef WITHOUT_INOTIFY
+    Log.Attempts = 0;
+    Log.iOld = -1;
+    Log.iNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Log.iNotify < 0 || !WatchLog(Log) ||
+        !Watch(EPOLL_CTL_ADD, Log.iNotify, EPOLLIN)) {
+        exit(EXIT_FAILURE);
+    }
+#else
+    // Start polling right away
+    Log.Interval = MinPollInterval;
+    ArmTimer(Log.Tick, 0, MinPollInterval * 1000000, 0);
+#endif
+
+    // Control socket is optional, don't fail without it
+    if (!OpenControl()) {
+        syslog(LOG_NOTICE, "Failed to open control socket %s", ControlFile);
+    }
+
+    // Everything happens in this loop, from one batch of events to the next
+    // There's no wakeup unless something has to be done
+    time_t Armed = 0;
+    bool Running = true;
+    while (Running) {
+        struct epoll_event Events[MaxEvents];
+        bool Reload = false;
+
+        // Don't wait if there's still some dump to stream
+        int Ready = epoll_wait(EventLoop, Events, MaxEvents, (ControlPending() ? 0 : -1));
+        if (Ready < 0) {
+            if (errno == EINTR) {
+                continue;
             }
 
-            Hosts.pop_back();
+            syslog(LOG_CRIT, "Failed to wait for events. Quitting.");
+            break;
         }
 
-#ifdef WITHOUT_INOTIFY
-        sleep(1);
+        for (int Event = 0; Event < Ready; ++Event) {
+            int FD = Events[Event].data.fd;
+
+            if (FD == Signals) {
+                struct signalfd_siginfo Info;
+                while (read(Signals, &Info, sizeof(Info)) == sizeof(Info)) {
+                    if (Info.ssi_signo == SIGHUP) {
+                        Reload = true;
+                    } else {
+                        // Finish the batch first
+                        Running = false;
+                    }
+                }
+            } else if (FD == Expiry) {
+                // Purge happens below
+                DrainTimer(Expiry);
+            } else if (FD == Log.Tick) {
+                DrainTimer(Log.Tick);
+                if (!OnLogTick(Log, Hosts)) {
+                    Running = false;
+                }
+#ifndef WITHOUT_INOTIFY
+            } else if (FD == Log.iNotify) {
+                if (!OnLogEvents(Log, Hosts)) {
+                    Running = false;
+                }
 #endif
+            } else {
+                ServeControl(FD, Events[Event].events, Hosts);
+            }
+        }
+
+        // Let pending dumps progress
+        ServeControl(-1, 0, Hosts);
+
+        if (Reload) {
+            LoadRules(Failures);
+            syslog(LOG_INFO, "Rules reloaded");
+        }
+
+        PurgeHosts(Hosts);
+
+        // Wake up when the next host expires
+        time_t Next = (Hosts.Expiries.empty() ? 0 : (*Hosts.Expiries.begin())->Expire);
+        if (Next != Armed) {
+            ArmTimer(Expiry, Next, 0, TFD_TIMER_ABSTIME);
+            Armed = Next;
+        }
+    }
+
+    // Leave a trace of what the rules did
+    for (std::vector<Rule>::const_iterator it = Failures.Rules.begin();
+         it != Failures.Rules.end(); ++it) {
+        syslog(LOG_INFO, "Rule %s matched %lu lines", (*it).Name.c_str(), (*it).Hits);
     }
+    syslog(LOG_INFO, "Deamon shutting down.");
 
+    CloseControl();
 #ifndef WITHOUT_INOTIFY
-    inotify_rm_watch(iNotify, iAuth);
-    close(iNotify);
+    close(Log.iNotify);
 #endif
-    close(AuthLog);
+    if (Log.File != -1) {
+        close(Log.File);
+    }
+    if (Log.Old != -1) {
+        close(Log.Old);
+    }
+    close(Log.Tick);
+    close(Expiry);
+    close(Signals);
+    close(EventLoop);
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Replays every capture in tests/ and compares the outcome
+# with the matching .expected file
+
+srcdir=${srcdir:-.}
+Status=0
+
+for Capture in "$srcdir"/tests/*.capture; do
+    Expected="${Capture%.capture}.expected"
+    Name=$(basename "$Capture" .capture)
+
+    # The first line names the capture, it depends on where it lives
+    if ./ForbidHosts -4 -6 -y 2015 -f "$srcdir/forbidhosts.rules" -r "$Capture" 2>/dev/null |
+       sed 1d | diff -u "$Expected" - ; then
+        echo "PASS: $Name"
+    else
+        echo "FAIL: $Name"
+        Status=1
+    fi
+done
+
+exit $Status